@@ -1,6 +1,7 @@
 #include "datalink.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "protocol.h"
@@ -15,99 +16,130 @@ struct FRAME {
     unsigned int padding;
 };
 
-static unsigned char frame_nr = 0, buffer[PKT_LEN], nbuffered;
-static unsigned char frame_expected = 0;
-static int phl_ready = 0;
+/* per-link protocol state */
+struct station {
+    link_t *link;
+    unsigned char frame_nr, buffer[PKT_LEN], nbuffered;
+    unsigned char frame_expected;
+    int phl_ready;
+};
 
-static void put_frame(unsigned char *frame, int len) {
+static void put_frame(struct station *st, unsigned char *frame, int len) {
     *(unsigned int *)(frame + len) = crc32(frame, len);
-    send_frame(frame, len + 4);
-    phl_ready = 0;
+    link_send_frame(st->link, frame, len + 4);
+    st->phl_ready = 0;
 }
 
-static void send_data_frame(void) {
-    struct FRAME s;
+/* header, payload and CRC go out as they are, without assembling the frame */
+static void put_frame_iov(struct station *st, unsigned char *head, int head_len,
+                          unsigned char *data, int len) {
+    struct iovec iov[3];
+    unsigned int crc = crc32_update(crc32(head, head_len), data, len);
+
+    iov[0].iov_base = head;
+    iov[0].iov_len = head_len;
+    iov[1].iov_base = data;
+    iov[1].iov_len = len;
+    iov[2].iov_base = &crc;
+    iov[2].iov_len = 4;
+    link_send_frame_iov(st->link, iov, 3);
+    st->phl_ready = 0;
+}
+
+static void send_data_frame(struct station *st) {
+    unsigned char head[3];
 
-    s.kind = FRAME_DATA;
-    s.seq = frame_nr;
-    s.ack = 1 - frame_expected;
-    memcpy(s.data, buffer, PKT_LEN);
+    head[0] = FRAME_DATA;
+    head[1] = 1 - st->frame_expected; /* ack */
+    head[2] = st->frame_nr;           /* seq */
 
-    dbg_frame("Send DATA %d %d, ID %d\n", s.seq, s.ack, *(short *)s.data);
+    dbg_frame("Send DATA %d %d, ID %d\n", head[2], head[1], *(short *)st->buffer);
 
-    put_frame((unsigned char *)&s, 3 + PKT_LEN);
-    start_timer(frame_nr, DATA_TIMER);
+    put_frame_iov(st, head, 3, st->buffer, PKT_LEN);
+    link_start_timer(st->link, st->frame_nr, DATA_TIMER);
 }
 
-static void send_ack_frame(void) {
+static void send_ack_frame(struct station *st) {
     struct FRAME s;
 
     s.kind = FRAME_ACK;
-    s.ack = 1 - frame_expected;
+    s.ack = 1 - st->frame_expected;
 
     dbg_frame("Send ACK  %d\n", s.ack);
 
-    put_frame((unsigned char *)&s, 2);
+    put_frame(st, (unsigned char *)&s, 2);
 }
 
-int main(int argc, char **argv) {
-    int event, arg;
-    struct FRAME f;
+static void handle_event(link_t *link, int event, int arg) {
+    struct station *st = link_user(link);
+    const unsigned char *p;
+    const struct FRAME *f;
     int len = 0;
 
-    protocol_init(argc, argv);
-    lprintf("Designed by Jiang Yanjun, build: " __DATE__
-            "  "__TIME__
-            "\n");
-
-    disable_network_layer();
-
-    for (;;) {
-        event = wait_for_event(&arg);
-
-        switch (event) {
-            case NETWORK_LAYER_READY:
-                get_packet(buffer);
-                nbuffered++;
-                send_data_frame();
+    switch (event) {
+        case NETWORK_LAYER_READY:
+            link_get_packet(link, st->buffer);
+            st->nbuffered++;
+            send_data_frame(st);
+            break;
+
+        case PHYSICAL_LAYER_READY:
+            st->phl_ready = 1;
+            break;
+
+        case FRAME_RECEIVED:
+            /* parsed in place, no copy of the frame */
+            len = link_recv_frame_view(link, &p);
+            f = (const struct FRAME *)p;
+            if (len < 5 || len > (int)sizeof(*f) || crc32((unsigned char *)p, len) != 0) {
+                dbg_event("**** Receiver Error, Bad CRC Checksum\n");
+                link_recv_frame_release(link);
                 break;
+            }
+            if (f->kind == FRAME_ACK) dbg_frame("Recv ACK  %d\n", f->ack);
+            if (f->kind == FRAME_DATA) {
+                dbg_frame("Recv DATA %d %d, ID %d\n", f->seq, f->ack,
+                          *(short *)f->data);
+                if (f->seq == st->frame_expected) {
+                    link_put_packet(link, (unsigned char *)f->data, len - 7);
+                    st->frame_expected = 1 - st->frame_expected;
+                }
+                send_ack_frame(st);
+            }
+            if (f->ack == st->frame_nr) {
+                link_stop_timer(link, st->frame_nr);
+                st->nbuffered--;
+                st->frame_nr = 1 - st->frame_nr;
+            }
+            link_recv_frame_release(link);
+            break;
+
+        case DATA_TIMEOUT:
+            dbg_event("---- DATA %d timeout\n", arg);
+            send_data_frame(st);
+            break;
+    }
 
-            case PHYSICAL_LAYER_READY:
-                phl_ready = 1;
-                break;
+    if (st->nbuffered < 1 && st->phl_ready)
+        link_enable_network_layer(link);
+    else
+        link_disable_network_layer(link);
+}
 
-            case FRAME_RECEIVED:
-                len = recv_frame((unsigned char *)&f, sizeof f);
-                if (len < 5 || crc32((unsigned char *)&f, len) != 0) {
-                    dbg_event("**** Receiver Error, Bad CRC Checksum\n");
-                    break;
-                }
-                if (f.kind == FRAME_ACK) dbg_frame("Recv ACK  %d\n", f.ack);
-                if (f.kind == FRAME_DATA) {
-                    dbg_frame("Recv DATA %d %d, ID %d\n", f.seq, f.ack,
-                              *(short *)f.data);
-                    if (f.seq == frame_expected) {
-                        put_packet(f.data, len - 7);
-                        frame_expected = 1 - frame_expected;
-                    }
-                    send_ack_frame();
-                }
-                if (f.ack == frame_nr) {
-                    stop_timer(frame_nr);
-                    nbuffered--;
-                    frame_nr = 1 - frame_nr;
-                }
-                break;
+int main(int argc, char **argv) {
+    int i;
 
-            case DATA_TIMEOUT:
-                dbg_event("---- DATA %d timeout\n", arg);
-                send_data_frame();
-                break;
-        }
+    protocol_init(argc, argv);
+    lprintf("Designed by Jiang Yanjun, build: " __DATE__
+            "  "__TIME__
+            "\n");
 
-        if (nbuffered < 1 && phl_ready)
-            enable_network_layer();
-        else
-            disable_network_layer();
+    for (i = 0; i < link_count(); i++) {
+        struct station *st = calloc(1, sizeof(struct station));
+        st->link = link_get(i);
+        link_set_user(st->link, st);
+        link_disable_network_layer(st->link);
     }
-}
\ No newline at end of file
+
+    link_run(handle_event);
+}
@@ -0,0 +1,126 @@
+/*
+    datalink.c written against protocol.hpp: stop-and-wait with 1-bit
+    sequence numbers, a coroutine sending and one receiving per link.
+
+        gcc -O2 -c protocol.c lprintf.c crc32.c
+        g++ -std=c++20 -O2 -o datalink_co datalink_co.cpp protocol.o lprintf.o crc32.o -lm -lpthread
+*/
+
+#include "datalink.h"
+
+#include "protocol.hpp"
+
+#define DATA_TIMER 2000
+
+struct FRAME {
+    unsigned char kind; /* FRAME_DATA */
+    unsigned char ack;
+    unsigned char seq;
+    unsigned char data[PKT_LEN];
+    unsigned int padding;
+};
+
+/* per-link protocol state */
+struct station {
+    dl::link link;
+    unsigned char frame_nr = 0, frame_expected = 0;
+    unsigned char buffer[PKT_LEN];
+
+    explicit station(link_t *lk) : link(lk, 2) {}
+};
+
+static void send_data_frame(station &st)
+{
+    unsigned char head[3];
+    struct iovec iov[3];
+    unsigned int crc;
+
+    head[0] = FRAME_DATA;
+    head[1] = 1 - st.frame_expected; /* ack */
+    head[2] = st.frame_nr;           /* seq */
+    crc = crc32_update(crc32(head, 3), st.buffer, PKT_LEN);
+
+    dbg_frame("Send DATA %d %d, ID %d\n", head[2], head[1], *(short *)st.buffer);
+
+    iov[0].iov_base = head;
+    iov[0].iov_len = 3;
+    iov[1].iov_base = st.buffer;
+    iov[1].iov_len = PKT_LEN;
+    iov[2].iov_base = &crc;
+    iov[2].iov_len = 4;
+    st.link.send_frame_iov(iov, 3);
+}
+
+static void send_ack_frame(station &st)
+{
+    struct FRAME s;
+
+    s.kind = FRAME_ACK;
+    s.ack = 1 - st.frame_expected;
+
+    dbg_frame("Send ACK  %d\n", s.ack);
+
+    *(unsigned int *)((unsigned char *)&s + 2) = crc32((unsigned char *)&s, 2);
+    st.link.send_frame((unsigned char *)&s, 6);
+}
+
+/* a packet at a time, sent again until the receiver stops its timer */
+static dl::task sender(station &st)
+{
+    unsigned char seq;
+
+    for (;;) {
+        co_await st.link.network_ready();
+        st.link.get_packet(st.buffer);
+        seq = st.frame_nr;
+        do {
+            co_await st.link.phl_ready();
+            if (st.frame_nr != seq) /* acknowledged meanwhile */
+                break;
+            send_data_frame(st);
+            st.link.start_timer(seq, DATA_TIMER);
+        } while (co_await st.link.timeout(seq));
+    }
+}
+
+static dl::task receiver(station &st)
+{
+    unsigned char buf[DL_FRAME_MAX];
+    const struct FRAME *f = (const struct FRAME *)buf;
+    int len;
+
+    for (;;) {
+        len = co_await st.link.frame(buf, sizeof(buf));
+        if (len < 5 || len > (int)sizeof(*f) || crc32(buf, len) != 0) {
+            dbg_event("**** Receiver Error, Bad CRC Checksum\n");
+            continue;
+        }
+        if (f->kind == FRAME_ACK)
+            dbg_frame("Recv ACK  %d\n", f->ack);
+        if (f->kind == FRAME_DATA) {
+            dbg_frame("Recv DATA %d %d, ID %d\n", f->seq, f->ack, *(short *)f->data);
+            if (f->seq == st.frame_expected) {
+                st.link.put_packet((unsigned char *)f->data, len - 7);
+                st.frame_expected = 1 - st.frame_expected;
+            }
+            send_ack_frame(st);
+        }
+        if (f->ack == st.frame_nr) {
+            st.link.stop_timer(st.frame_nr); /* the sender moves on */
+            st.frame_nr = 1 - st.frame_nr;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    protocol_init(argc, argv);
+
+    for (int i = 0; i < link_count(); i++) {
+        station *st = new station(link_get(i));
+        sender(*st);
+        receiver(*st);
+    }
+
+    dl::run();
+}
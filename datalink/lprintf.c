@@ -20,7 +20,8 @@
 
 #include "lprintf.h"
 
-FILE *log_file = NULL;
+THREAD_LOCAL FILE *log_file = NULL;
+THREAD_LOCAL int log_echo = 1;
 
 #define bool int
 #define true 1
@@ -35,14 +36,15 @@ static unsigned long skip_to(const char *format) {
 }
 
 #define tee_output(buf, len) do { \
-    fwrite(buf, 1, len, stdout); \
+    if (log_echo)                    \
+        fwrite(buf, 1, len, stdout); \
 	if (log_file)                    \
         fwrite(buf, 1, len, log_file); \
 } while (0)
 
 static size_t output(const char *str, size_t len)
 {
-	static bool sol = true; /* start of line */
+	static THREAD_LOCAL bool sol = true; /* start of line */
 	unsigned int ms, n;
 	char timestamp[32];
 	const char *head, *tail, *end = str + len;
@@ -0,0 +1,389 @@
+#ifndef __PROTOCOL_fr12hn_HPP__
+#define __PROTOCOL_fr12hn_HPP__
+
+/*
+    C++20 coroutine front-end of protocol.h
+
+    A protocol is written as coroutines awaiting events of a dl::link
+    instead of a switch over wait_for_event():
+
+        dl::task sender(dl::link &L, unsigned char seq)
+        {
+            for (;;) {
+                L.start_timer(seq, DATA_TIMER);
+                if (!co_await L.timeout(seq))   // false: stop_timer(seq), acked
+                    break;
+                L.send_frame(...);              // expired: resend
+            }
+        }
+
+        dl::task receiver(dl::link &L)
+        {
+            for (;;) {
+                dl::frame f = co_await L.frame();
+                ...
+            }
+        }
+
+    Awaiting never allocates: every awaiter lives in the frame of the
+    coroutine that awaits it and is linked into the waiting list of its
+    link. Timer slots are sized by the constructor (ntimer), a timer No.
+    beyond them grows the slots once, on its first use. A wakeup only
+    moves the awaiter to the link's ready list, which is drained after
+    each event, so a coroutine that wakes others (by stopping a timer,
+    say) never nests resumptions. dl::run() hands the events of all links
+    to their dl::link, each link is driven by a single thread.
+
+    The network layer is enabled exactly while some coroutine awaits
+    network_ready(); once resumed it must call get_packet() before its next
+    co_await.
+*/
+
+#include <coroutine>
+#include <cstring>
+#include <exception>
+#include <vector>
+
+#include "protocol.h"
+
+namespace dl {
+
+/* Fire-and-forget coroutine, runs on call, its frame is freed when it returns */
+struct task {
+    struct promise_type {
+        task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+#define DL_FRAME_MAX (PKT_LEN + 16)
+
+struct frame {
+    int len;
+    unsigned char data[DL_FRAME_MAX];
+};
+
+namespace detail {
+
+struct waiter {
+    std::coroutine_handle<> handle;
+    waiter *next = nullptr;
+    int result = 0;
+};
+
+/* intrusive FIFO of waiters */
+struct waitq {
+    waiter *head = nullptr, *tail = nullptr;
+
+    bool empty() const { return head == nullptr; }
+
+    void push(waiter *w)
+    {
+        w->next = nullptr;
+        if (tail)
+            tail->next = w;
+        else
+            head = w;
+        tail = w;
+    }
+
+    waiter *pop()
+    {
+        waiter *w = head;
+        if (w && (head = w->next) == nullptr)
+            tail = nullptr;
+        return w;
+    }
+};
+
+} // namespace detail
+
+class link {
+    enum { IDLE, RUNNING, FIRED };
+
+    struct timer_slot {
+        int state = IDLE;
+        detail::waiter *waiter = nullptr;
+    };
+
+public:
+    explicit link(link_t *lk, unsigned int ntimer = 0) : lk_(lk), timers_(ntimer)
+    {
+        link_set_user(lk_, this);
+        link_disable_network_layer(lk_);
+    }
+
+    link(const link &) = delete;
+    link &operator=(const link &) = delete;
+
+    link_t *handle() const { return lk_; }
+    const char *station() const { return link_station_name(lk_); }
+
+    /* Plain calls, see protocol.h */
+
+    void send_frame(unsigned char *frame, int len)
+    {
+        link_send_frame(lk_, frame, len);
+        phl_ready_ = false;
+    }
+
+    void send_frame_iov(const struct iovec *iov, int iovcnt)
+    {
+        link_send_frame_iov(lk_, iov, iovcnt);
+        phl_ready_ = false;
+    }
+
+    int  get_packet(unsigned char *packet) { return link_get_packet(lk_, packet); }
+    void put_packet(unsigned char *packet, int len) { link_put_packet(lk_, packet, len); }
+    int  phl_sq_len() const { return link_phl_sq_len(lk_); }
+    bool phl_is_ready() const { return phl_ready_; }
+
+    void start_timer(unsigned int nr, unsigned int ms)
+    {
+        link_start_timer(lk_, nr, ms);
+        slot(nr).state = RUNNING;
+    }
+
+    /* stops the timer, a coroutine awaiting its timeout resumes with false */
+    void stop_timer(unsigned int nr)
+    {
+        link_stop_timer(lk_, nr);
+        if (nr < timers_.size())
+            settle(timers_[nr], false);
+    }
+
+    void start_ack_timer(unsigned int ms)
+    {
+        link_start_ack_timer(lk_, ms);
+        if (ack_.state == IDLE)
+            ack_.state = RUNNING;
+    }
+
+    void stop_ack_timer()
+    {
+        link_stop_ack_timer(lk_);
+        settle(ack_, false);
+    }
+
+    /* Awaitables, living in the frame of the awaiting coroutine */
+
+    struct frame_awaiter : detail::waiter {
+        link &l;
+        unsigned char *buf;
+        int size;
+
+        /* result -1: the frame is still to be received, also when await_ready() skips await_suspend() */
+        frame_awaiter(link &l, unsigned char *buf, int size) : l(l), buf(buf), size(size) { result = -1; }
+        frame_awaiter(const frame_awaiter &) = delete;
+
+        bool await_ready() const noexcept { return l.frames_ > 0; }
+
+        void await_suspend(std::coroutine_handle<> h) noexcept
+        {
+            handle = h;
+            l.frame_q_.push(this);
+        }
+
+        int await_resume()
+        {
+            if (result >= 0) /* handed over with the event */
+                return result;
+            l.frames_--;
+            return l.receive(buf, size);
+        }
+    };
+
+    struct frame_value_awaiter : frame_awaiter {
+        dl::frame f;
+
+        explicit frame_value_awaiter(link &l) : frame_awaiter(l, f.data, sizeof(f.data)) {}
+
+        dl::frame await_resume()
+        {
+            f.len = frame_awaiter::await_resume();
+            return f;
+        }
+    };
+
+    struct timeout_awaiter : detail::waiter {
+        link &l;
+        int nr;             /* -1: the ACK timer */
+
+        timeout_awaiter(link &l, int nr) : l(l), nr(nr) {}
+        timeout_awaiter(const timeout_awaiter &) = delete;
+
+        /* a timer that is not running never expires, an expiry nobody awaited is taken */
+        bool await_ready() noexcept
+        {
+            timer_slot &t = l.slot(nr);
+
+            if (t.state == RUNNING)
+                return false;
+            result = t.state == FIRED;
+            t.state = IDLE;
+            return true;
+        }
+
+        void await_suspend(std::coroutine_handle<> h) noexcept
+        {
+            handle = h;
+            l.slot(nr).waiter = this;
+        }
+
+        bool await_resume() const noexcept { return result != 0; }
+    };
+
+    struct event_awaiter : detail::waiter {
+        link &l;
+        detail::waitq &q;
+        bool ready;
+
+        event_awaiter(link &l, detail::waitq &q, bool ready) : l(l), q(q), ready(ready) {}
+        event_awaiter(const event_awaiter &) = delete;
+
+        bool await_ready() const noexcept { return ready; }
+
+        void await_suspend(std::coroutine_handle<> h) noexcept
+        {
+            handle = h;
+            q.push(this);
+            l.update_network_layer();
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    /* next received frame: its length, copied to buf as far as it fits */
+    frame_awaiter frame(unsigned char *buf, int size) { return frame_awaiter(*this, buf, size); }
+
+    /* next received frame, by value */
+    frame_value_awaiter frame() { return frame_value_awaiter(*this); }
+
+    /* true if data timer 'nr' expired, false if it was stopped (or is not running) */
+    timeout_awaiter timeout(unsigned int nr)
+    {
+        slot(nr);
+        return timeout_awaiter(*this, (int)nr);
+    }
+
+    timeout_awaiter ack_timeout() { return timeout_awaiter(*this, -1); }
+
+    /* the network layer offers a packet, fetch it with get_packet() */
+    event_awaiter network_ready() { return event_awaiter(*this, net_q_, false); }
+
+    /* the sending queue of the physical layer is low */
+    event_awaiter phl_ready() { return event_awaiter(*this, phl_q_, phl_ready_); }
+
+    /* Executor: the handler for link_run() */
+
+    static void dispatch(link_t *lk, int event, int arg)
+    {
+        static_cast<link *>(link_user(lk))->on_event(event, arg);
+    }
+
+private:
+    timer_slot &slot(int nr)
+    {
+        if (nr < 0)
+            return ack_;
+        if ((unsigned int)nr >= timers_.size())
+            timers_.resize(nr + 1);
+        return timers_[nr];
+    }
+
+    void wake(detail::waiter *w, int result)
+    {
+        w->result = result;
+        ready_.push(w);
+    }
+
+    /* the timer is over: wake its waiter, or keep an expiry for a later await */
+    void settle(timer_slot &t, bool expired)
+    {
+        if (t.waiter) {
+            wake(t.waiter, expired);
+            t.waiter = nullptr;
+            t.state = IDLE;
+        } else
+            t.state = expired ? FIRED : IDLE;
+    }
+
+    /* the full length, a frame longer than size is cut, not fatal */
+    int receive(unsigned char *buf, int size)
+    {
+        const unsigned char *p;
+        int len = link_recv_frame_view(lk_, &p);
+
+        std::memcpy(buf, p, len < size ? len : size);
+        link_recv_frame_release(lk_);
+        return len;
+    }
+
+    void update_network_layer()
+    {
+        if (net_q_.empty())
+            link_disable_network_layer(lk_);
+        else
+            link_enable_network_layer(lk_);
+    }
+
+    void on_event(int event, int arg)
+    {
+        detail::waiter *w;
+
+        switch (event) {
+        case NETWORK_LAYER_READY:
+            if ((w = net_q_.pop()) != nullptr)
+                wake(w, 0);
+            break;
+
+        case PHYSICAL_LAYER_READY:
+            phl_ready_ = true;
+            while ((w = phl_q_.pop()) != nullptr)
+                wake(w, 0);
+            break;
+
+        case FRAME_RECEIVED:
+            if ((w = frame_q_.pop()) != nullptr) {
+                frame_awaiter *fw = static_cast<frame_awaiter *>(w);
+                wake(fw, receive(fw->buf, fw->size));
+            } else
+                frames_++;
+            break;
+
+        case DATA_TIMEOUT:
+            if ((unsigned int)arg < timers_.size())
+                settle(timers_[arg], true);
+            break;
+
+        case ACK_TIMEOUT:
+            settle(ack_, true);
+            break;
+        }
+
+        while ((w = ready_.pop()) != nullptr)
+            w->handle.resume();
+
+        update_network_layer();
+    }
+
+    link_t *lk_;
+    int frames_ = 0;          /* received frames nobody awaited yet */
+    bool phl_ready_ = true;
+    detail::waitq frame_q_, net_q_, phl_q_, ready_;
+    std::vector<timer_slot> timers_;
+    timer_slot ack_;
+};
+
+/* Run all links; never returns */
+inline void run()
+{
+    link_run(link::dispatch);
+}
+
+} // namespace dl
+
+#endif
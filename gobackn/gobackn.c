@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include "gobackn.h"
@@ -19,69 +20,86 @@ typedef struct {
     unsigned int Padding;
 } Frame;
 
-static SeqNr FrameToSend = 0;
-static SeqNr AckExpected = 0;
-static SeqNr FrameExpected = 0;
+// 每条链路的协议状态
+typedef struct {
+    link_t* Link;
+
+    SeqNr FrameToSend;
+    SeqNr AckExpected;
+    SeqNr FrameExpected;
 
-static bool NoNAK = true;
-static bool PhlReady = false;
+    bool NoNAK;
+    bool PhlReady;
 
-static int FrameLength = 0;
+    int FrameLength;
 
-static unsigned char Buffer[MAX_SEQ + 1][PKT_LEN];
-static int PacketLength[MAX_SEQ + 1];
+    unsigned char Buffer[MAX_SEQ + 1][PKT_LEN];
+    int PacketLength[MAX_SEQ + 1];
 
-static SeqNr NBuffered = 0;
+    SeqNr NBuffered;
+} Window;
 
 // 发送帧到物理层
-static void PutFrame(unsigned char* Frame, int Len) {
+static void PutFrame(Window* W, unsigned char* Frame, int Len) {
     *(unsigned int*)(Frame + Len) = crc32(Frame, Len);
-    send_frame(Frame, Len + 4);
+    link_send_frame(W->Link, Frame, Len + 4);
+}
+
+// 分段发送帧: 帧头、数据和CRC直接编码进发送队列，不拼装整帧
+static void PutFrameIOV(Window* W, unsigned char* Head, int HeadLen, unsigned char* Data, int Len) {
+    struct iovec IOV[3];
+    unsigned int CRC = crc32_update(crc32(Head, HeadLen), Data, Len);
+
+    IOV[0].iov_base = Head;
+    IOV[0].iov_len = HeadLen;
+    IOV[1].iov_base = Data;
+    IOV[1].iov_len = Len;
+    IOV[2].iov_base = &CRC;
+    IOV[2].iov_len = 4;
+    link_send_frame_iov(W->Link, IOV, 3);
 }
 
 // 发送数据帧
-static void SendData(SeqNr FrameNr, SeqNr FrameExpected, unsigned char* Packet, size_t Len) {
-    Frame S;
+static void SendData(Window* W, SeqNr FrameNr, SeqNr FrameExpected, unsigned char* Packet, size_t Len) {
+    unsigned char Head[3];
 
-    S.Kind = FRAME_DATA;
-    S.Seq = FrameNr;
-    S.Ack = (FrameExpected + MAX_SEQ) % (MAX_SEQ + 1);
+    Head[0] = FRAME_DATA;
+    Head[1] = (FrameExpected + MAX_SEQ) % (MAX_SEQ + 1);  // Ack
+    Head[2] = FrameNr;                                    // Seq
 
     if (Len > PKT_LEN) {
         dbg_frame("Error while sending packet %d with ack %d: Length too large.\n",
-                  S.Seq, S.Ack, Len);
+                  Head[2], Head[1], Len);
         return;
     }
-    
-    memcpy(S.Data, Packet, PKT_LEN);
 
-    dbg_frame("Packet sent: seq = %d, ack = %d, data id = %d\n", 
-              S.Seq, S.Ack, *(short*)S.Data);
+    dbg_frame("Packet sent: seq = %d, ack = %d, data id = %d\n",
+              Head[2], Head[1], *(short*)Packet);
 
-    // 发送帧: kind + ack + seq + 数据
-    PutFrame((unsigned char*)&S, 3 + PKT_LEN);
+    // 发送帧: kind + ack + seq + 数据，数据直接取自发送缓冲区
+    PutFrameIOV(W, Head, 3, Packet, PKT_LEN);
 }
 
 // 发送ACK帧
-static void SendACK(unsigned char FrameExpected) {
+static void SendACK(Window* W, unsigned char FrameExpected) {
     Frame S;
 
     S.Kind = FRAME_ACK;
     S.Ack = (FrameExpected + MAX_SEQ) % (MAX_SEQ + 1);
 
     dbg_frame("Send ACK %d\n", S.Ack);
-    PutFrame((unsigned char*)&S, 2);
+    PutFrame(W, (unsigned char*)&S, 2);
 }
 
 // 发送NAK帧
-static void SendNAK(unsigned char FrameExpected) {
+static void SendNAK(Window* W, unsigned char FrameExpected) {
     Frame S;
 
     S.Kind = FRAME_NAK;
     S.Ack = (FrameExpected + MAX_SEQ) % (MAX_SEQ + 1);
 
     dbg_frame("Send NAK %d\n", S.Ack);
-    PutFrame((unsigned char*)&S, 2);
+    PutFrame(W, (unsigned char*)&S, 2);
 }
 
 // 判断序号是否在窗口范围内
@@ -90,120 +108,126 @@ static inline bool Between(unsigned char A, unsigned char B, unsigned char C) {
 }
 
 // 处理网络层就绪事件
-static void NetworkReadyHandler() {
+static void NetworkReadyHandler(Window* W, int* Arg) {
     // 从网络层获取数据包
-    PacketLength[FrameToSend] = get_packet(Buffer[FrameToSend]);
-    
+    W->PacketLength[W->FrameToSend] = link_get_packet(W->Link, W->Buffer[W->FrameToSend]);
+
     // 增加窗口大小
-    NBuffered++;
-    
+    W->NBuffered++;
+
     // 发送数据帧
-    SendData(FrameToSend, FrameExpected, Buffer[FrameToSend], PacketLength[FrameToSend]);
-    start_timer(FrameToSend, DATA_TIMER);
-    stop_ack_timer();
+    SendData(W, W->FrameToSend, W->FrameExpected, W->Buffer[W->FrameToSend], W->PacketLength[W->FrameToSend]);
+    link_start_timer(W->Link, W->FrameToSend, DATA_TIMER);
+    link_stop_ack_timer(W->Link);
 
-    INC(FrameToSend);
-    PhlReady = false;
+    INC(W->FrameToSend);
+    W->PhlReady = false;
 }
 
 // 处理物理层就绪事件
-static void PhysicalReadyHandler() {
-    PhlReady = true;
+static void PhysicalReadyHandler(Window* W, int* Arg) {
+    W->PhlReady = true;
 }
 
 // 处理帧接收事件
-static void FrameReceivedHandler() {
-    // 从物理层接收帧
-    Frame F;
-    FrameLength = recv_frame((unsigned char*)(&F), sizeof(F));
-    
+static void FrameReceivedHandler(Window* W, int* Arg) {
+    // 从物理层接收帧，在接收缓冲区中原地解析
+    const unsigned char* P;
+    W->FrameLength = link_recv_frame_view(W->Link, &P);
+    const Frame* F = (const Frame*)P;
+
     // 检查帧CRC校验
-    if (FrameLength < 5 || crc32((unsigned char*)&F, FrameLength) != 0) {
+    if (W->FrameLength < 5 || W->FrameLength > (int)sizeof(Frame) || crc32((unsigned char*)P, W->FrameLength) != 0) {
+        link_recv_frame_release(W->Link);
         dbg_event("Bad CRC Checksum, Receive Error!!!\n");
-        
-        if (NoNAK) {
-            SendNAK(FrameExpected);
-            NoNAK = false;
-            stop_ack_timer();
+
+        if (W->NoNAK) {
+            SendNAK(W, W->FrameExpected);
+            W->NoNAK = false;
+            link_stop_ack_timer(W->Link);
         }
 
         return;
     }
-    
+
     // 记录接收到的帧
-    if (F.Kind == FRAME_ACK) 
-        dbg_frame("Recv ACK %d\n", F.Ack);
-        
-    if (F.Kind == FRAME_NAK) 
-        dbg_frame("Recv NAK %d\n", F.Ack);
-        
-    if (F.Kind == FRAME_DATA) {
-        dbg_frame("Recv DATA %d %d, ID %d\n", F.Seq, F.Ack, *(short*)F.Data);
-        
+    if (F->Kind == FRAME_ACK)
+        dbg_frame("Recv ACK %d\n", F->Ack);
+
+    if (F->Kind == FRAME_NAK)
+        dbg_frame("Recv NAK %d\n", F->Ack);
+
+    if (F->Kind == FRAME_DATA) {
+        dbg_frame("Recv DATA %d %d, ID %d\n", F->Seq, F->Ack, *(short*)F->Data);
+
         // 处理按序到达的数据帧
-        if (F.Seq == FrameExpected) {
-            put_packet(F.Data, FrameLength - 7);
-            NoNAK = true;
-            INC(FrameExpected);
-            start_ack_timer(ACK_TIMER);
-        } 
+        if (F->Seq == W->FrameExpected) {
+            link_put_packet(W->Link, (unsigned char*)F->Data, W->FrameLength - 7);
+            W->NoNAK = true;
+            INC(W->FrameExpected);
+            link_start_ack_timer(W->Link, ACK_TIMER);
+        }
         // 发送NAK请求重传
-        else if (NoNAK) {
-            SendNAK(FrameExpected);
-            NoNAK = false;
-            stop_ack_timer();
+        else if (W->NoNAK) {
+            SendNAK(W, W->FrameExpected);
+            W->NoNAK = false;
+            link_stop_ack_timer(W->Link);
         }
     }
 
     // 滑动发送窗口，确认已接收的帧
-    while (Between(AckExpected, F.Ack, FrameToSend)) {
-        NBuffered--;
-        stop_timer(AckExpected);
-        INC(AckExpected);
+    while (Between(W->AckExpected, F->Ack, W->FrameToSend)) {
+        W->NBuffered--;
+        link_stop_timer(W->Link, W->AckExpected);
+        INC(W->AckExpected);
     }
 
+    // 帧已处理完，归还接收缓冲区
+    bool IsNAK = F->Kind == FRAME_NAK;
+    link_recv_frame_release(W->Link);
+
     // 处理NAK，重传指定帧
-    if (F.Kind == FRAME_NAK) {
-        stop_timer(AckExpected);
-        SeqNr ResendStart = AckExpected;
-        
+    if (IsNAK) {
+        link_stop_timer(W->Link, W->AckExpected);
+        SeqNr ResendStart = W->AckExpected;
+
         // 回退N步，重传所有已发送但未确认的帧
-        for (SeqNr i = 0; i < NBuffered; i++) {
-            SendData(ResendStart, FrameExpected, Buffer[ResendStart], PacketLength[ResendStart]);
-            start_timer(ResendStart, DATA_TIMER);
-            stop_ack_timer();
+        for (SeqNr i = 0; i < W->NBuffered; i++) {
+            SendData(W, ResendStart, W->FrameExpected, W->Buffer[ResendStart], W->PacketLength[ResendStart]);
+            link_start_timer(W->Link, ResendStart, DATA_TIMER);
+            link_stop_ack_timer(W->Link);
             INC(ResendStart);
         }
 
-        PhlReady = false;
+        W->PhlReady = false;
     }
 }
 
 // 处理数据超时事件
-static void DataTimeoutHandler(int* Arg) {
+static void DataTimeoutHandler(Window* W, int* Arg) {
     dbg_event("---- DATA %d timeout\n", *Arg);
-    
+
     // 回退N步，重传所有已发送但未确认的帧
-    SeqNr ResendStart = AckExpected;
-    
-    for (SeqNr i = 0; i < NBuffered; i++) {
-        SendData(ResendStart, FrameExpected, Buffer[ResendStart], PacketLength[ResendStart]);
-        start_timer(ResendStart, DATA_TIMER);
-        stop_ack_timer();
+    SeqNr ResendStart = W->AckExpected;
+
+    for (SeqNr i = 0; i < W->NBuffered; i++) {
+        SendData(W, ResendStart, W->FrameExpected, W->Buffer[ResendStart], W->PacketLength[ResendStart]);
+        link_start_timer(W->Link, ResendStart, DATA_TIMER);
+        link_stop_ack_timer(W->Link);
         INC(ResendStart);
     }
 
-    PhlReady = false;
+    W->PhlReady = false;
 }
 
 // 处理ACK超时事件
-static void ACKTimeoutHandler() {
-    SendACK(FrameExpected);
-    stop_ack_timer();
+static void ACKTimeoutHandler(Window* W, int* Arg) {
+    SendACK(W, W->FrameExpected);
+    link_stop_ack_timer(W->Link);
 }
 
 // 事件处理函数表
-void (*EventHandler[])(int*) = {
+void (*EventHandler[])(Window*, int*) = {
     [NETWORK_LAYER_READY] = NetworkReadyHandler,
     [PHYSICAL_LAYER_READY] = PhysicalReadyHandler,
     [FRAME_RECEIVED] = FrameReceivedHandler,
@@ -211,24 +235,32 @@ void (*EventHandler[])(int*) = {
     [ACK_TIMEOUT] = ACKTimeoutHandler,
 };
 
-int main(int argc, char** argv) {
-    int Event, Arg;
+// 处理一条链路上的一个事件
+static void Dispatch(link_t* Link, int Event, int Arg) {
+    Window* W = link_user(Link);
+
+    // 调用对应的事件处理函数
+    EventHandler[Event](W, &Arg);
 
+    // 根据窗口状态启用/禁用网络层
+    if (W->NBuffered < MAX_SEQ && W->PhlReady)
+        link_enable_network_layer(Link);
+    else
+        link_disable_network_layer(Link);
+}
+
+int main(int argc, char** argv) {
     protocol_init(argc, argv);
-    disable_network_layer();
-    
-    for (;;) {
-        Event = wait_for_event(&Arg);
-
-        // 调用对应的事件处理函数
-        EventHandler[Event](&Arg);
-
-        // 根据窗口状态启用/禁用网络层
-        if (NBuffered < MAX_SEQ && PhlReady)
-            enable_network_layer();
-        else
-            disable_network_layer();
+
+    for (int i = 0; i < link_count(); i++) {
+        Window* W = calloc(1, sizeof(Window));
+        W->Link = link_get(i);
+        W->NoNAK = true;
+        link_set_user(W->Link, W);
+        link_disable_network_layer(W->Link);
     }
 
+    link_run(Dispatch);
+
     return 0;
-}    
\ No newline at end of file
+}
@@ -8,7 +8,17 @@ extern "C"
 #include <stdarg.h>
 #include <stdio.h>
 
-extern FILE *log_file;
+#ifndef THREAD_LOCAL
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+#endif
+
+/* per thread: every worker thread logs for the link it is driving */
+extern THREAD_LOCAL FILE *log_file;
+extern THREAD_LOCAL int log_echo;   /* copy the output to stdout */
 extern unsigned int get_ms(void);
 
 size_t lprintf(const char *format, ...);
@@ -2,13 +2,24 @@
 #define _CRT_SECURE_NO_WARNINGS
 #endif
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* pthread_setaffinity_np() */
+#endif
+
 #include <time.h>
+#include <limits.h>
+
+#include "lprintf.h"
 
 static time_t epoch; /* epoch timestamp (be same for Station A & B) */
+static int mode_simulate = 0; /* run both stations on a virtual clock */
+static THREAD_LOCAL int sim_now = 0; /* virtual clock (ms) of the running shard */
 
 #ifdef _WIN32 /* for Windows Visual Studio */
 
 #include <winsock.h>
+#include <windows.h>
+#include <process.h>
 #include <io.h>
 #include <stdio.h>
 #include <sys/types.h>
@@ -36,11 +47,62 @@ unsigned int get_ms(void)
 {
 	struct _timeb tm;
 
+	if (mode_simulate)
+		return (unsigned int)sim_now;
+
 	_ftime(&tm);
 
 	return (unsigned int)(epoch ? (tm.time - epoch) * 1000 + tm.millitm : 0);
 }
 
+/* Worker threads of the sharded engine */
+
+#define THREAD HANDLE
+#define THREAD_FUNC unsigned __stdcall
+
+static double wall_clock(void)
+{
+	LARGE_INTEGER freq, now;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart / freq.QuadPart;
+}
+
+static long long mono_ns(void)
+{
+	LARGE_INTEGER freq, now;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return now.QuadPart / freq.QuadPart * 1000000000LL + now.QuadPart % freq.QuadPart * 1000000000LL / freq.QuadPart;
+}
+
+static int cpu_count(void)
+{
+	SYSTEM_INFO si;
+
+	GetSystemInfo(&si);
+	return (int)si.dwNumberOfProcessors;
+}
+
+static int thread_start(THREAD *th, unsigned (__stdcall *fn)(void *), void *arg)
+{
+	*th = (HANDLE)_beginthreadex(NULL, 0, fn, arg, 0, NULL);
+	return *th ? 0 : -1;
+}
+
+static void thread_join(THREAD th)
+{
+	WaitForSingleObject(th, INFINITE);
+	CloseHandle(th);
+}
+
+static void thread_pin(int cpu)
+{
+	SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << (cpu % (8 * sizeof(DWORD_PTR))));
+}
+
 #pragma comment(lib,"wsock32.lib")
 
 #else /* for Linux */
@@ -48,6 +110,7 @@ unsigned int get_ms(void)
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <stdlib.h>
@@ -56,6 +119,31 @@ unsigned int get_ms(void)
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#ifdef MFD_CLOEXEC
+#define HAVE_MEMFD
+#endif
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT
+#include <sys/syscall.h>
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#include <linux/errqueue.h>
+#define HAVE_ZEROCOPY
+#endif
+#endif
 #define stricmp strcasecmp
 #define Sleep(ms) usleep((ms) * 1000)
 #define socket_init()
@@ -66,81 +154,508 @@ unsigned int get_ms(void)
 	struct timeval tm;
 	struct timezone tz;
 
+	if (mode_simulate)
+		return (unsigned int)sim_now;
+
 	gettimeofday(&tm, &tz);
 
 	return (unsigned int)(epoch ? (tm.tv_sec - epoch) * 1000 + tm.tv_usec / 1000 : 0);
 }
 
+/* Worker threads of the sharded engine */
+
+#define THREAD pthread_t
+#define THREAD_FUNC void *
+
+static double wall_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long long mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cpu_count(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? (int)n : 1;
+}
+
+static int thread_start(THREAD *th, void *(*fn)(void *), void *arg)
+{
+	return pthread_create(th, NULL, fn, arg);
+}
+
+static void thread_join(THREAD th)
+{
+	pthread_join(th, NULL);
+}
+
+static void thread_pin(int cpu)
+{
+#ifdef __linux__
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
 #endif
 
 #include <math.h>
 
+/* SIMD nibble encoder: SSE2 wherever the target has it, AVX2 if the CPU has it */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_SSE2
+#include <emmintrin.h>
+#if defined(__AVX2__)
+#define HAVE_AVX2
+#define AVX2_TARGET
+#include <immintrin.h>
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_AVX2
+#define AVX2_TARGET __attribute__((target("avx2")))
+#include <immintrin.h>
+#endif
+#endif
+
 #include "protocol.h"
 
-/* channel parameters */
+/* channel parameters, defaults of --delay and --bps */
 #define CHAN_DELAY 270       /* ms */
 #define CHAN_BPS   8000      /* bits per second */
 
-#define ABORT(s) do { lprintf("\nFATAL: %s\nAbort.\n", s); exit(0); } while(0)
+#define ABORT(s) do { log_echo = 1; lprintf("\nFATAL: %s\nAbort.\n", s); exit(0); } while(0)
 
 #define DEFAULT_TICK 15 /* ms */
 #define DEFAULT_CHAN_BER   1.0E-5    /* Bit Error Rate */
 #define DEFAULT_PORT  59144
+#define DEFAULT_SEED  0x098bcde1
+#define DEFAULT_NTIMER (64 * 1024) /* data timers per link */
+#define ENGINE_NTIMER  256         /* data timers per link when hosting many links */
+#define ENGINE_SQ_SIZE (32 * 1024) /* sending queue per link when hosting many links */
 
 #define NMAGIC     32
 #define HEAD_MAGIC 0xa5a5e41b
 #define FOOT_MAGIC 0xf5125a5a
 
 static void magic_init(void);
+static void encoder_init(void);
 static void magic_check(void);
 
 static unsigned int head_magic[NMAGIC];
 
 /* Parameters */
-static int station;
-static double ber = DEFAULT_CHAN_BER;  /* Bit Error Rate */
-static int mode_ibib = 0;    /* 0: BUSY-IDLE-BUSY-..., 1: IDLE-BUSY-BUSY-... */
-static int mode_flood = 0;   /* flood mode */
+static struct link_opts opts = { 'a', DEFAULT_CHAN_BER, 0, 0, 0, 0, FRAMING_NIBBLE, { CHAN_BPS, CHAN_BPS }, { CHAN_DELAY, CHAN_DELAY }, 0, 0, { { 0, 0, 0, 0, 0, JITTER_UNIFORM }, { 0, 0, 0, 0, 0, JITTER_UNIFORM } }, { 0, 0, 0, 0 }, { NULL, NULL }, DEFAULT_SEED, 0 };
 static int mode_cycle = 100;  /* seconds */
 static int mode_life = 0x7fffff00;
 static int mode_tick = DEFAULT_TICK;
-static int mode_seed = 0x098bcde1;
 static int debug_mask = 0; /* debug mask */
 static unsigned short port = DEFAULT_PORT;
+static int mode_pairs = 1;    /* simulated link pairs */
+static int mode_threads = 0;  /* worker threads, 0: one per CPU */
+static int mode_uring = 0;    /* io_uring transport for the TCP channel */
+static int mode_zerocopy = 0; /* MSG_ZEROCOPY for large sends on the TCP channel */
+static int blk_size;          /* bytes per block of the delay line, see config() */
+
+/* Link Context */
+
+/* Sending queue structure */
+
+#define SQ_SIZE (128 * 1024) /* default, more for a fast channel */
+#define SQ_SIZE_MAX (512 * 1024 * 1024)
+#define PHL_SQ_LEVEL 50 /* nibble-coded bytes at CHAN_BPS, see link_open() for lk->sq_level */
+
+#define ZEROCOPY_MIN (16 * 1024) /* smaller sends are cheaper to copy */
+#define ZC_INFLIGHT  64          /* zerocopy sends awaiting completion */
+
+/* Receiving block of the delay line */
+
+#define BLKSIZE (16 * CHAN_BPS / 8 / (1000 / DEFAULT_TICK)) /* at the default rate, the minimum */
+#define BLKSIZE_MAX (256 * 1024)
+
+struct BLK {
+    int commit_ts;           /* ms the bytes were handed to the channel */
+    int rptr, wptr;
+    long long arrive_ns;     /* arrival of data[0], the others follow at the line rate */
+    long long bps;           /* ... of the time it was handed to the channel */
+    struct BLK *link;
+    unsigned char *data;     /* blk_size bytes, allocated behind the header */
+};
+
+#define RX_IDLE INT_MAX /* no frame due in the delay line */
+
+#define BLK_GROW 32 /* blocks a pool grows by */
+
+struct BLK_CHUNK {
+    struct BLK_CHUNK *link;
+};
+
+/* Timer wheel node (see Timer Management) */
+
+struct TIMER {
+    int deadline;
+    int prev, next;
+    int list;       /* list the timer is linked in, -1: not running */
+};
+
+#define TIMER_PENDING (-2) /* expired, timeout waiting in a batch */
+
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN   (1u << (WHEEL_BITS * WHEEL_LEVELS))
+
+/* xoshiro256**, a random stream of a link */
+struct rng {
+    unsigned long long s[4];
+};
+
+enum { RNG_TRAFFIC, RNG_GAP, RNG_NOISE, RNG_IMPAIR };
+
+/* Position in a channel trace: the next row, read ahead */
+struct trace_cur {
+    const struct trace_map *map; /* NULL: no trace */
+    size_t pos;              /* where the row after it starts */
+    int line;
+    int due;                 /* ms the row takes effect, INT_MAX: none left */
+    double ber;
+    int delay;
+    long long bps;           /* 0: unchanged */
+};
+
+/* Received frame */
+
+struct RCV_FRAME {
+    int len;
+    int state;
+    int size;                /* RF_SMALL or RF_MAX bytes of frame[] */
+    int due, skip;           /* impairment stage: ms to deliver, later frames to let by */
+    struct RCV_FRAME *link;
+    unsigned char *frame;    /* allocated behind the header */
+};
+
+#define RF_SMALL (PKT_LEN + 16) /* pooled frames hold any frame of the lab protocols */
+#define RF_MAX   2048           /* a frame is cut there, longer frames move to a buffer this big */
+
+#ifdef HAVE_IO_URING
 
-static SOCKET sock;
-static int now; /* timestamp (ms) */
-static int noise = 0; /* counter of bit errors */
+/* io_uring transport state, see uring_open() */
+
+#define URING_ENTRIES 16
+#define URING_NBUF    64   /* provided receive buffers, power of 2 */
+#define URING_BGID    0
+
+#define UD_RECV 1
+#define UD_SEND 2
+
+struct uring {
+    int fd;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_sz, cq_sz, sqes_sz;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sqe_tail, to_submit;
+
+    struct io_uring_buf_ring *br;  /* provided receive buffers */
+    unsigned char *bufs;
+    unsigned short br_tail;
+
+    int multishot, recv_armed;
+    int fixed_send;
+    int sending;                   /* sends in flight */
+    int send_busy;                 /* their bytes were counted as busy */
+};
+
+#endif
+
+struct link {
+    struct link_opts opts;
+    int station;
+    void *user;
+    FILE *log;
+
+    /* channel: TCP socket, or an in-memory peer on the virtual clock */
+    SOCKET sock;
+    struct uring *uring;     /* io_uring transport, NULL: send()/recv() */
+    int zerocopy;            /* MSG_ZEROCOPY on sends of ZEROCOPY_MIN bytes or more */
+    unsigned int zc_sent, zc_done;          /* zerocopy sends issued / completed */
+    int zc_start[ZC_INFLIGHT];              /* sq position of a send in flight */
+    unsigned char zc_complete[ZC_INFLIGHT]; /* completed, waiting for older ones */
+    struct link *peer;
+    struct BLK *tx_blk;      /* pending bytes for the peer, sent at tx_blk->commit_ts */
+    int epoll_fd, timer_fd;
+
+    int now;                 /* timestamp (ms) */
+    unsigned long long noise; /* counter of bit errors */
+    unsigned long long nbits;
+    int noisy;               /* 0: an error-free channel */
+    int ge_bad;              /* Gilbert-Elliott state, 1: bad, always 0 with a plain ber */
+    double ber_log[2];       /* log(1 - BER) of the good and the bad state */
+    double ge_stay[2];       /* log(1 - p), log(1 - r): staying in the state for another bit */
+    long long ge_left;       /* bits before the state changes */
+    long long ber_gap;       /* error-free bits before the next error, -1: not drawn yet */
+    struct rng noise_rng;
+    unsigned long long ge_bits[2], ge_errors[2], ge_bursts; /* per state, bad states entered */
+    long long tx_bps, rx_bps; /* line rate of the channel out of / into this station */
+    int rx_delay;            /* propagation delay (ms) of the channel into this station */
+    struct trace_cur tx_trace, rx_trace; /* the channel traces out of / into this station followed */
+
+    /* physical layer: sender */
+    unsigned char *sq;
+    int sq_size, sq_head, sq_tail;
+    int sq_mirror;           /* mapped twice back to back, see sq_alloc() */
+    int wire;                /* bytes on the wire per frame byte: 2 nibble coding, 1 HDLC */
+    int sq_level;            /* PHYSICAL_LAYER_READY below this many queued bytes */
+    int inform_phl_ready;
+    int send_ts;             /* timestamp of last socket_send() */
+
+    /* token-bucket pacer of the transmitter, counting bytes on the wire */
+    long long pace_ns;       /* pacer clock at the last refill, -1: not started */
+    long long tokens;        /* bytes that may be sent now */
+    long long token_rem;     /* fraction of a byte earned, bit*ns (< 8e9) */
+    long long burst;         /* bucket size */
+    long long fill_ns;       /* time to fill an empty bucket */
+    int backlog;             /* bytes were left queued at the last send */
+    long long busy_ns, busy_bytes; /* time spent with a backlog, bytes sent in it */
+    double busy_bits;        /* bits the line could carry in busy_ns, as its rate went */
+
+    /* physical layer: receiver, the delay line in order of arrival */
+    struct BLK *rblk_head, *rblk_tail;
+    long long rx_clock;      /* the line carries earlier bytes until then (ns, before the delay) */
+    long long rx_last;       /* arrival of the last byte in the delay line (ns) */
+    int rx_next;             /* ms the next frame is complete, RX_IDLE: none in the delay line */
+    int rx_due;              /* ms the receiver has something to do, the next frame or a release */
+
+    /* pool of the delay line blocks, grown by chunks up to blk_cap */
+    struct BLK *blk_free;
+    struct BLK_CHUNK *blk_chunks;
+    int blk_cap, blk_total;  /* capacity, blocks allocated */
+    int blk_used, blk_high;  /* blocks in use, most ever in use */
+    unsigned long long blk_exhausted, blk_dropped; /* allocations failed, bytes lost with them */
+    struct RCV_FRAME *rf_head, *rf_tail, *rf_buf;
+    struct RCV_FRAME *rf_free, *rf_view; /* pool of RF_SMALL frames, frame under recv_frame_view() */
+    int rf_count, rf_told;   /* frames queued / announced by poll_events() */
+
+    /* impairment stage of the frames off the line, see imp_frame() */
+    struct link_impair imp;  /* of the direction into this station */
+    int impaired;            /* any of them configured */
+    struct RCV_FRAME *imp_head, *imp_tail; /* frames waiting for their due time, in order */
+    struct RCV_FRAME *imp_held;            /* frames held back for later ones to overtake */
+    struct rng imp_rng;
+    unsigned long long imp_frames, imp_dropped, imp_duped, imp_held_back;
+    long long imp_delay;     /* extra delay (ms) drawn, in total */
+
+    /* events handed out by poll_events() and not withdrawn */
+    struct event *batch;
+    int batch_n, batch_pos;  /* entries before batch_pos are delivered */
+
+    /* timers */
+    struct TIMER *timer;
+    int ntimer;              /* data timers, the ACK timer is No. ntimer */
+    unsigned long long wheel_bits[WHEEL_LEVELS]; /* non-empty slots */
+    unsigned int wheel_now;  /* all timers <= wheel_now are expired */
+
+    /* shard scheduling (simulation) */
+    int deadline;            /* key in the shard's deadline heap */
+    int heap_pos;
+
+    /* network layer */
+    int network_layer_active;
+    int layer3_ready;
+    int rpackets;
+    long long rbytes;
+    int nl_ts;               /* timestamp of last packet handed to data link layer */
+    int nl_prev_ts;          /* nl_ts before it, restored if the packet is withdrawn */
+    int nl_gap;              /* station B idle gap (ms) for the current packet */
+    int pkt_no;
+    struct rng tx_rng, rx_rng; /* payload of the packets sent / expected */
+    struct rng gap_rng;      /* station B idle gaps */
+    unsigned int rframes;
+    int ts0, stat_ts;
+};
+
+static link_t **links;
+static int nlinks;
+static THREAD_LOCAL link_t *cur_link; /* link used by the single-link API */
+
+static void link_select(link_t *lk)
+{
+    cur_link = lk;
+    log_file = lk->log;
+}
+
+char *link_station_name(link_t *lk)
+{
+    return (char *)(lk->station == 'a' ? "A" : lk->station == 'b' ? "B" : "XXX");
+}
 
 char *station_name(void)
 {
-    return (char *)(station == 'a' ? "A" : station == 'b' ? "B" : "XXX");
+    return cur_link ? link_station_name(cur_link) : (char *)"XXX";
 }
 
+/* long options without a short one */
+#define OPT_BPS_AB   256
+#define OPT_BPS_BA   257
+#define OPT_DELAY_AB 258
+#define OPT_DELAY_BA 259
+#define OPT_BURST    260
+#define OPT_BLK_POOL 261
+#define OPT_IMPAIR    262
+#define OPT_IMPAIR_AB 263
+#define OPT_IMPAIR_BA 264
+#define OPT_GILBERT   265
+#define OPT_TRACE     266
+#define OPT_TRACE_AB  267
+#define OPT_TRACE_BA  268
+#define OPT_SEED      269
+
 static struct option intopts[] = {
 	{ "help",	no_argument, NULL, '?' },
 	{ "utopia", no_argument, NULL, 'u' },
 	{ "flood",	no_argument, NULL, 'f' },
 	{ "ibib",	no_argument, NULL, 'i' },
 	{ "nolog",  no_argument, NULL, 'n' },
+	{ "simulate", no_argument, NULL, 's' },
 	{ "debug",	required_argument, NULL, 'd' },
 	{ "port",	required_argument, NULL, 'p' },
 	{ "ber",	required_argument, NULL, 'b' },
 	{ "log",	required_argument, NULL, 'l' },
 	{ "ttl",    required_argument, NULL, 't' },
+	{ "links",  required_argument, NULL, 'L' },
+	{ "threads", required_argument, NULL, 'T' },
+	{ "uring",  no_argument, NULL, 'U' },
+	{ "zerocopy", no_argument, NULL, 'Z' },
+	{ "framing", required_argument, NULL, 'F' },
+	{ "sq-size", required_argument, NULL, 'Q' },
+	{ "bps",    required_argument, NULL, 'B' },
+	{ "bps-ab", required_argument, NULL, OPT_BPS_AB },
+	{ "bps-ba", required_argument, NULL, OPT_BPS_BA },
+	{ "delay",  required_argument, NULL, 'D' },
+	{ "delay-ab", required_argument, NULL, OPT_DELAY_AB },
+	{ "delay-ba", required_argument, NULL, OPT_DELAY_BA },
+	{ "burst",  required_argument, NULL, OPT_BURST },
+	{ "blk-pool", required_argument, NULL, OPT_BLK_POOL },
+	{ "impair", required_argument, NULL, OPT_IMPAIR },
+	{ "impair-ab", required_argument, NULL, OPT_IMPAIR_AB },
+	{ "impair-ba", required_argument, NULL, OPT_IMPAIR_BA },
+	{ "gilbert", required_argument, NULL, OPT_GILBERT },
+	{ "trace", required_argument, NULL, OPT_TRACE },
+	{ "trace-ab", required_argument, NULL, OPT_TRACE_AB },
+	{ "trace-ba", required_argument, NULL, OPT_TRACE_BA },
+	{ "seed", required_argument, NULL, OPT_SEED },
 	{ 0, 0, 0, 0 },
 };
 
-#define OPT_SHORT "?ufind:p:b:l:t:"
+#define OPT_SHORT "?ufinsUZd:p:b:l:t:L:T:F:Q:B:D:"
+
+/* "<n>[k|M|G]", decimal multiples */
+static long long parse_rate(const char *s)
+{
+	char *end;
+	double v = strtod(s, &end);
+
+	if (*end == 'k' || *end == 'K')
+		v *= 1e3;
+	else if (*end == 'm' || *end == 'M')
+		v *= 1e6;
+	else if (*end == 'g' || *end == 'G')
+		v *= 1e9;
+
+	return (long long)(v + 0.5);
+}
+
+/* "loss=<p>,dup=<p>,reorder=<p>[:<depth>],jitter=<ms>[:uniform|exp|normal]", any of them */
+static int parse_impair(const char *s, struct link_impair *imp)
+{
+	static const char *dists[] = { "uniform", "exp", "normal" };
+	const char *eq;
+	char *end;
+	double v;
+	int i;
+
+	memset(imp, 0, sizeof(*imp));
+	while (*s) {
+		if ((eq = strchr(s, '=')) == NULL)
+			return 0;
+		v = strtod(eq + 1, &end);
+		if (end == eq + 1 || v < 0.0)
+			return 0;
+
+		if (strncmp(s, "loss=", 5) == 0 && v <= 1.0)
+			imp->loss = v;
+		else if (strncmp(s, "dup=", 4) == 0 && v <= 1.0)
+			imp->dup = v;
+		else if (strncmp(s, "reorder=", 8) == 0 && v <= 1.0) {
+			imp->reorder = v;
+			if (*end == ':') {
+				imp->depth = (int)strtol(end + 1, &end, 10);
+				if (imp->depth < 1 || imp->depth > 1000)
+					return 0;
+			}
+		} else if (strncmp(s, "jitter=", 7) == 0 && v <= 60000) {
+			imp->jitter = (int)v;
+			if (*end == ':') {
+				for (i = 0; i < 3; i++)
+					if (strncmp(end + 1, dists[i], strlen(dists[i])) == 0)
+						break;
+				if (i == 3)
+					return 0;
+				imp->jitter_dist = i;
+				end += 1 + strlen(dists[i]);
+			}
+		} else
+			return 0;
+
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return 0;
+		s = end;
+	}
+
+	return 1;
+}
+
+static void impair_print(const char *dir, const struct link_impair *imp)
+{
+	static const char *dists[] = { "uniform", "exponential", "normal" };
+
+	if (imp->loss == 0.0 && imp->dup == 0.0 && imp->reorder == 0.0 && imp->jitter == 0)
+		return;
+	lprintf("Impairments%s: loss %g, duplication %g, reordering %g by %d at most, jitter %d ms %s\n",
+		dir, imp->loss, imp->dup, imp->reorder, imp->depth > 0 ? imp->depth : 3, imp->jitter, dists[imp->jitter_dist]);
+}
+
+static char log_name[1024];
+static int log_per_station = 0; /* append "-A.log"/"-B.log" to log_name */
 
 static void config(int argc, char **argv)
 {
-	char fname[1024];
+	char *fname = log_name, *end;
+	long size;
+	long long rate;
+	struct link_impair imp;
 	int opt;
 
 	if (argc < 2) {
 	usage:
-		printf("\nUsage:\n  %s <options> <station-name>\n", argv[0]);
+		printf("\nUsage:\n  %s <options> <station-name>\n  %s --simulate <options>\n", argv[0], argv[0]);
 		printf(
 			"\nOptions : \n"
 			"    -?, --help : print this\n"
@@ -148,17 +663,45 @@ static void config(int argc, char **argv)
 			"    -f, --flood : flood traffic\n"
 			"    -i, --ibib  : set station B layer 3 sender mode as IDLE-BUSY-IDLE-BUSY-...\n"
 			"    -n, --nolog : do not create log file\n"
+			"    -s, --simulate : run station A and B together on a virtual clock (no TCP)\n"
+			"    -U, --uring : TCP channel through io_uring (Linux), fall back to send()/recv()\n"
+			"    -Z, --zerocopy : MSG_ZEROCOPY for large sends on the TCP channel (Linux)\n"
 			"    -d, --debug=<0-7>: debug mask (bit0:event, bit1:frame, bit2:warning)\n"
 			"    -p, --port=<port#> : TCP port number (default: %u)\n"
 			"    -b, --ber=<ber> : Bit Error Rate (received data only)\n"
+			"    --gilbert=<p>,<r>,<ber-bad>[,<ber-good>] : burst errors instead, a bad state entered\n"
+			"                    with probability p and left with r per bit (default ber-good: 0)\n"
 			"    -l, --log=<filename> : using assigned file as log file\n"
 			"    -t, --ttl=<seconds> : set time-to-live\n"
+			"    -L, --links=<n> : simulate n link pairs (implies --simulate)\n"
+			"    -T, --threads=<n> : worker threads sharing the links (default: one per CPU)\n"
+			"    -F, --framing=<nibble|hdlc> : line coding of frames, the same at both stations\n"
+			"                    (default: nibble, hdlc: byte stuffing, half the bytes)\n"
+			"    -Q, --sq-size=<bytes>[K|M] : sending queue of the physical layer\n"
+			"                    (default: 128K, or 100 ms of a faster channel)\n"
+			"    -B, --bps=<rate>[k|M|G] : line rate, bits per second (default: %d)\n"
+			"    -D, --delay=<ms> : propagation delay, 11 ms or more (default: %d)\n"
+			"    --bps-ab, --bps-ba, --delay-ab, --delay-ba : the same for one direction\n"
+			"    --burst=<bytes>[K|M] : bytes the transmitter may send at once (default: 2 ticks)\n"
+			"    --blk-pool=<n> : receive blocks in flight at most, more are dropped (default: the delay line)\n"
+			"    --impair=<list> : impair received frames, any of loss=<p>, dup=<p>,\n"
+			"                    reorder=<p>[:<depth>], jitter=<ms>[:uniform|exp|normal]\n"
+			"    --impair-ab, --impair-ba : the same for one direction\n"
+			"    --trace=<file> : follow a channel trace, rows of <seconds> <ber> <delay-ms> [<rate>]\n"
+			"                    (the BER is ignored with --gilbert)\n"
+			"    --trace-ab, --trace-ba : the same for one direction\n"
+			"    --seed=<n> : of the noise, traffic and impairments, the same at both stations\n"
+			"                    (default: %llu)\n"
 			"\n"
 			"i.e.\n"
 			"    %s -fd3 -b 1e-4 A\n"
 			"    %s --flood --debug=3 --ber=1e-4 A\n"
+			"    %s --simulate --flood --ttl=600\n"
+			"    %s --links=2000 --threads=8 --flood --ttl=60\n"
+			"    %s --simulate --flood --bps=1G --delay=600 --sq-size=256M\n"
+			"    %s --simulate --flood --impair=loss=0.01,reorder=0.02:4,jitter=30:exp\n"
 			"\n",
-			DEFAULT_PORT, argv[0], argv[0]);
+			DEFAULT_PORT, CHAN_BPS, CHAN_DELAY, (unsigned long long)DEFAULT_SEED, argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
 		exit(0);
 	}
 
@@ -170,21 +713,34 @@ static void config(int argc, char **argv)
 			goto usage;
 
 		case 'u':
-			ber = 0.0;
+			opts.ber = 0.0;
+			opts.ge.p = 0.0;
 			break;
 
 		case 'f':
-			mode_flood = 1;
+			opts.flood = 1;
 			break;
 
 		case 'i':
-			mode_ibib = 1;
+			opts.ibib = 1;
 			break;
 
 		case 'n':
 			strcpy(fname, "nul");
 			break;
 
+		case 's':
+			mode_simulate = 1;
+			break;
+
+		case 'U':
+			mode_uring = 1;
+			break;
+
+		case 'Z':
+			mode_zerocopy = 1;
+			break;
+
 		case 'd':
 			debug_mask = atoi(optarg);
 			break;
@@ -194,9 +750,9 @@ static void config(int argc, char **argv)
 			break;
 
 		case 'b':
-			ber = strtod(optarg, 0);
-			if (ber >= 1.0) {
-				printf("Bad BER %.3f\n", ber);
+			opts.ber = strtod(optarg, 0);
+			if (opts.ber >= 1.0) {
+				printf("Bad BER %.3f\n", opts.ber);
 				goto usage;
 			}
 			break;
@@ -209,116 +765,635 @@ static void config(int argc, char **argv)
 			mode_life = atoi(optarg) * 1000; /* ms */
 			break;
 
+		case 'L':
+			mode_pairs = atoi(optarg);
+			if (mode_pairs < 1) {
+				printf("Bad number of links %s\n", optarg);
+				goto usage;
+			}
+			mode_simulate = 1;
+			break;
+
+		case 'T':
+			mode_threads = atoi(optarg);
+			break;
+
+		case 'F':
+			if (stricmp(optarg, "nibble") == 0)
+				opts.framing = FRAMING_NIBBLE;
+			else if (stricmp(optarg, "hdlc") == 0)
+				opts.framing = FRAMING_HDLC;
+			else {
+				printf("Bad framing %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case 'Q':
+			size = strtol(optarg, &end, 0);
+			if (*end == 'k' || *end == 'K')
+				size *= 1024;
+			else if (*end == 'm' || *end == 'M')
+				size *= 1024 * 1024;
+			if (size < 4096 || size > 512 * 1024 * 1024) {
+				printf("Bad sending queue size %s (4K ~ 512M)\n", optarg);
+				goto usage;
+			}
+			opts.sq_size = (int)size;
+			break;
+
+		case 'B':
+		case OPT_BPS_AB:
+		case OPT_BPS_BA:
+			rate = parse_rate(optarg);
+			if (rate < 100 || rate > 100000000000LL) {
+				printf("Bad line rate %s (100 ~ 100G)\n", optarg);
+				goto usage;
+			}
+			if (opt != OPT_BPS_BA)
+				opts.bps[0] = rate;
+			if (opt != OPT_BPS_AB)
+				opts.bps[1] = rate;
+			break;
+
+		case 'D':
+		case OPT_DELAY_AB:
+		case OPT_DELAY_BA:
+			size = atol(optarg);
+			if (size < 11 || size > 60000) {
+				printf("Bad propagation delay %s (11 ~ 60000 ms)\n", optarg);
+				goto usage;
+			}
+			if (opt != OPT_DELAY_BA)
+				opts.delay[0] = (int)size;
+			if (opt != OPT_DELAY_AB)
+				opts.delay[1] = (int)size;
+			break;
+
+		case OPT_BURST:
+			size = strtol(optarg, &end, 0);
+			if (*end == 'k' || *end == 'K')
+				size *= 1024;
+			else if (*end == 'm' || *end == 'M')
+				size *= 1024 * 1024;
+			if (size < 1 || size > SQ_SIZE_MAX) {
+				printf("Bad burst size %s\n", optarg);
+				goto usage;
+			}
+			opts.burst = size;
+			break;
+
+		case OPT_BLK_POOL:
+			size = atol(optarg);
+			if (size < 1 || size > 1000000) {
+				printf("Bad block pool size %s (1 ~ 1000000)\n", optarg);
+				goto usage;
+			}
+			opts.blk_pool = (int)size;
+			break;
+
+		case OPT_IMPAIR:
+		case OPT_IMPAIR_AB:
+		case OPT_IMPAIR_BA:
+			if (!parse_impair(optarg, &imp)) {
+				printf("Bad impairments %s\n", optarg);
+				goto usage;
+			}
+			if (opt != OPT_IMPAIR_BA)
+				opts.impair[0] = imp;
+			if (opt != OPT_IMPAIR_AB)
+				opts.impair[1] = imp;
+			break;
+
+		case OPT_GILBERT:
+			memset(&opts.ge, 0, sizeof(opts.ge));
+			if (sscanf(optarg, "%lf,%lf,%lf,%lf", &opts.ge.p, &opts.ge.r, &opts.ge.ber_bad, &opts.ge.ber_good) < 3
+				|| opts.ge.p <= 0.0 || opts.ge.p > 1.0 || opts.ge.r <= 0.0 || opts.ge.r > 1.0
+				|| opts.ge.ber_bad < 0.0 || opts.ge.ber_bad >= 1.0 || opts.ge.ber_good < 0.0 || opts.ge.ber_good >= 1.0) {
+				printf("Bad Gilbert-Elliott model %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case OPT_TRACE:
+		case OPT_TRACE_AB:
+		case OPT_TRACE_BA:
+			if (opt != OPT_TRACE_BA)
+				opts.trace[0] = optarg;
+			if (opt != OPT_TRACE_AB)
+				opts.trace[1] = optarg;
+			break;
+
+		case OPT_SEED:
+			opts.seed = strtoull(optarg, &end, 0);
+			if (end == optarg || *end != '\0') {
+				printf("Bad seed %s\n", optarg);
+				goto usage;
+			}
+			break;
+
 		default:
 			printf("ERROR: Unsupported option\n");
 			goto usage;
 		}
 	}
 
-	if (optind == argc) 
-		goto usage;
+	/* a block holds some 16 ticks of the faster direction */
+	rate = opts.bps[0] > opts.bps[1] ? opts.bps[0] : opts.bps[1];
+	rate = 16 * rate / 8 / (1000 / DEFAULT_TICK);
+	blk_size = (int)(rate < BLKSIZE ? BLKSIZE : rate > BLKSIZE_MAX ? BLKSIZE_MAX : rate);
+
+	if (!mode_simulate) {
+		if (optind == argc)
+			goto usage;
 
-	station = tolower(argv[optind++][0]);
-	if (station != 'a' && station != 'b')
-		ABORT("Station name must be 'A' or 'B'");
+		opts.station = tolower(argv[optind++][0]);
+		if (opts.station != 'a' && opts.station != 'b')
+			ABORT("Station name must be 'A' or 'B'");
+	}
 
 	if (fname[0] == 0) {
 		strcpy(fname, argv[0]);
 		if (stricmp(fname + strlen(fname) - 4, ".exe") == 0)
 			*(fname + strlen(fname) - 4) = 0;
-		strcat(fname, station == 'a' ? "-A.log" : "-B.log");
+		log_per_station = 1;
+	} else if (mode_simulate && stricmp(fname, "nul") != 0) {
+		/* a simulation opens both stations, each gets its own file */
+		if (strlen(fname) > 4 && stricmp(fname + strlen(fname) - 4, ".log") == 0)
+			*(fname + strlen(fname) - 4) = 0;
+		log_per_station = 1;
 	}
+}
 
-	if (stricmp(fname, "nul") == 0)
-		log_file = NULL;
-	else if ((log_file = fopen(fname, "w")) == NULL) 
+/* Open the log file of a link and print its banner */
+static FILE *log_create(char *fname, const char *suffix)
+{
+	FILE *fp = NULL;
+
+	strcpy(fname, log_name);
+	if (log_per_station)
+		strcat(fname, suffix);
+
+	if (stricmp(fname, "nul") != 0 && (fp = fopen(fname, "w")) == NULL)
 		printf("WARNING: Failed to create log file \"%s\": %s\n", fname, strerror(errno));
 
+	return fp;
+}
+
+static void log_banner(const char *title, const char *fname)
+{
 	lprintf(
 		"=============================================================\n"
-		"                    Station %s                               \n"
+		"                    %s                               \n"
 		"-------------------------------------------------------------\n",
-		station_name());
+		title);
 
 	lprintf("Protocol.lib, version %s, jiangyanjun0718@bupt.edu.cn\n", VERSION, __DATE__);
-	lprintf("Channel: %d bps, %d ms propagation delay, bit error rate ", CHAN_BPS, CHAN_DELAY);
-	if (ber > 0.0)
-		lprintf("%.1E\n", ber);
+	if (opts.bps[0] == opts.bps[1] && opts.delay[0] == opts.delay[1])
+		lprintf("Channel: %lld bps, %d ms propagation delay, bit error rate ", opts.bps[0], opts.delay[0]);
+	else
+		lprintf("Channel: A->B %lld bps %d ms, B->A %lld bps %d ms delay, bit error rate ",
+			opts.bps[0], opts.delay[0], opts.bps[1], opts.delay[1]);
+	if (opts.ge.p > 0.0)
+		lprintf("%.1E on average\n", (opts.ge.r * opts.ge.ber_good + opts.ge.p * opts.ge.ber_bad) / (opts.ge.p + opts.ge.r));
+	else if (opts.ber > 0.0)
+		lprintf("%.1E\n", opts.ber);
 	else
 		lprintf("0\n");
-	lprintf("Log file \"%s\", TCP port %d, debug mask 0x%02x\n", fname, port, debug_mask);
+	if (opts.ge.p > 0.0)
+		lprintf("Burst errors: Gilbert-Elliott, good to bad %g, bad to good %g per bit, BER %.1E good, %.1E bad\n",
+			opts.ge.p, opts.ge.r, opts.ge.ber_good, opts.ge.ber_bad);
+	if (opts.seed != DEFAULT_SEED)
+		lprintf("Random seed: %llu\n", opts.seed);
+	if (opts.framing == FRAMING_HDLC)
+		lprintf("Framing: HDLC, 0x7E flags, 0x7D escapes\n");
+	if (opts.trace[0] && opts.trace[1] && strcmp(opts.trace[0], opts.trace[1]) == 0)
+		lprintf("Channel trace: \"%s\"\n", opts.trace[0]);
+	else {
+		if (opts.trace[0])
+			lprintf("Channel trace A->B: \"%s\"\n", opts.trace[0]);
+		if (opts.trace[1])
+			lprintf("Channel trace B->A: \"%s\"\n", opts.trace[1]);
+	}
+	if (memcmp(&opts.impair[0], &opts.impair[1], sizeof(opts.impair[0])) == 0)
+		impair_print("", &opts.impair[0]);
+	else {
+		impair_print(" A->B", &opts.impair[0]);
+		impair_print(" B->A", &opts.impair[1]);
+	}
+	if (mode_simulate)
+		lprintf("Log file \"%s\", simulated channel on virtual clock, debug mask 0x%02x\n", fname, debug_mask);
+	else
+		lprintf("Log file \"%s\", TCP port %d, debug mask 0x%02x\n", fname, port, debug_mask);
 }
 
-/* Create Communication Sockets  */
-
-void protocol_init(int argc, char **argv)
+static void link_log_open(link_t *lk)
 {
-	SOCKET admin_sock;
-	int i;
-    struct sockaddr_in name;
+	char fname[1040], title[32];
 
-	socket_init();
-	magic_init();
+	lk->log = log_create(fname, lk->station == 'a' ? "-A.log" : "-B.log");
+	link_select(lk);
 
-	config(argc, argv);
-  
-    if (station == 'a') {
+	sprintf(title, "Station %s", link_station_name(lk));
+	log_banner(title, fname);
+}
 
-        srand(mode_seed ^ 97209);
+/*
+    Random streams: every link draws from xoshiro256** generators of its
+    own, one for each purpose, so the noise does not shift when the traffic
+    changes and no two links or threads share a state. A stream is picked
+    by the seed, the pair, the direction (0: A to B) and the purpose, and a
+    run is repeated bit for bit on any host with the same --seed. The
+    payload stream of a direction is the same at its sender and receiver,
+    the receiver checks the packets against it.
+*/
+
+/* splitmix64, expands a seed */
+static unsigned long long splitmix64(unsigned long long *state)
+{
+    unsigned long long z = *state += 0x9e3779b97f4a7c15ull;
 
-        name.sin_family = AF_INET;
-        name.sin_addr.s_addr = INADDR_ANY;
-        name.sin_port = htons(port);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
 
-        admin_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (admin_sock < 0) 
-            ABORT("Create TCP socket");
-        if (bind(admin_sock, (struct sockaddr *)&name, sizeof(name)) < 0) {
-            lprintf("Station A: Failed to bind TCP port %u", port);
-            ABORT("Station A failed to bind TCP port");
-        }
+#define rng_rotl(x, k) ((x) << (k) | (x) >> (64 - (k)))
 
-        listen(admin_sock, 5);
+static unsigned long long rng_next(struct rng *r)
+{
+    unsigned long long *s = r->s, x = rng_rotl(s[1] * 5, 7) * 9, t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rng_rotl(s[3], 45);
+    return x;
+}
 
-        lprintf("Station A is waiting for station B on TCP port %u ... ", port);
-        fflush(stdout);
+/* uniform in [0, 1) */
+static double rng_unit(struct rng *r)
+{
+    return (rng_next(r) >> 11) * (1.0 / 9007199254740992.0);
+}
 
-        sock = accept(admin_sock, 0, 0);
-        if (sock < 0) 
-            ABORT("Station A failed to communicate with station B");
-        lprintf("Done.\n");
+static void rng_seed(struct rng *r, const struct link_opts *o, int dir, int purpose)
+{
+    unsigned long long key = o->seed;
+    int i;
 
-        recv(sock, (char *)&epoch, sizeof(epoch), 0);
-    }
+    key = splitmix64(&key) ^ ((unsigned long long)o->pair << 8 | dir << 4 | purpose);
+    for (i = 0; i < 4; i++)
+        r->s[i] = splitmix64(&key);
+}
 
-    if (station == 'b') {
+static void sq_alloc(link_t *lk, int size);
+static void sq_free(link_t *lk);
+static void timer_init(link_t *lk);
+static void wait_init(link_t *lk);
+static void batch_cancel(link_t *lk, int event, int arg);
+#ifdef HAVE_IO_URING
+static int uring_open(link_t *lk);
+static void uring_close(struct uring *u);
+static void uring_send(link_t *lk, int n);
+static void uring_poll(link_t *lk);
+#endif
 
-        srand(mode_seed ^ 18231);
+static void trace_start(struct trace_cur *c, const char *name);
 
-        sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (sock < 0) 
-            ABORT("Create TCP socket");
+/* a block per ms of the delay line and what it carries, some to spare */
+#define blk_cap_for(lk) \
+    ((int)((lk)->rx_delay + (lk)->rx_bps * (lk)->wire / 8 * (lk)->rx_delay / 1000 / blk_size + 2 * BLK_GROW))
 
-        name.sin_family = AF_INET;
-        name.sin_addr.s_addr = inet_addr("127.0.0.1");
-        name.sin_port = htons((short)port);
+link_t *link_open(const struct link_opts *o)
+{
+    link_t *lk;
+    long long level, size;
+    int dir;
 
-        for (i = 0; i < 60; i++) {
-            lprintf("Station B is connecting station A (TCP port %u) ... ", port);
-            fflush(stdout);
+    lk = (link_t *)calloc(1, sizeof(link_t));
+    if (lk == NULL)
+        ABORT("No enough memory");
 
-            if (connect(sock, (struct sockaddr *)&name, sizeof(struct sockaddr_in)) < 0) {
-                lprintf("Failed!\n");
-                Sleep(2000);
-            } else {
-                lprintf("Done.\n");
-                break;
-            }
-        }
-        if (i == 6)
-            ABORT("Station B failed to connect station A");
+    lk->opts = *o;
+    lk->station = o->station;
+    lk->ntimer = o->ntimer > 0 ? o->ntimer : DEFAULT_NTIMER;
+    lk->wire = o->framing == FRAMING_HDLC ? 1 : 2;
+
+    /* direction 0 is A to B */
+    dir = lk->station == 'a' ? 0 : 1;
+    lk->tx_bps = o->bps[dir] > 0 ? o->bps[dir] : CHAN_BPS;
+    lk->rx_bps = o->bps[!dir] > 0 ? o->bps[!dir] : CHAN_BPS;
+    lk->rx_delay = o->delay[!dir] > 0 ? o->delay[!dir] : CHAN_DELAY;
+    if (lk->rx_delay < 11)
+        ABORT("Propagation delay must be 11 ms or more");
+
+    /* PHL_SQ_LEVEL lasts 25 ms at the default rate, so does the level at any rate */
+    level = (long long)PHL_SQ_LEVEL * lk->wire * lk->tx_bps / (2 * CHAN_BPS);
+    if (level < PHL_SQ_LEVEL * lk->wire / 2)
+        level = PHL_SQ_LEVEL * lk->wire / 2;
+    size = o->sq_size > 0 ? o->sq_size : SQ_SIZE;
+    if (o->sq_size <= 0 && size < 4 * level)
+        size = 4 * level < SQ_SIZE_MAX ? 4 * level : SQ_SIZE_MAX;
+    sq_alloc(lk, (int)size);
+    lk->sq_level = (int)(level < lk->sq_size / 2 ? level : lk->sq_size / 2);
+
+    /* the bucket must hold at least what a tick earns, 2 ticks by default */
+    lk->burst = (o->burst > 0 ? o->burst : 2LL * mode_tick * lk->tx_bps / 8000) * lk->wire;
+    if (lk->burst < lk->wire)
+        lk->burst = lk->wire;
+    if (lk->burst > SQ_SIZE_MAX)
+        lk->burst = SQ_SIZE_MAX;
+    lk->fill_ns = lk->burst * 8000000000LL / (lk->tx_bps * lk->wire) + 1;
+    lk->pace_ns = -1;
+    lk->rx_next = lk->rx_due = RX_IDLE;
+
+    lk->imp = o->impair[!dir];
+    if (lk->imp.depth <= 0)
+        lk->imp.depth = 3;
+    lk->impaired = lk->imp.loss > 0.0 || lk->imp.dup > 0.0 || lk->imp.reorder > 0.0 || lk->imp.jitter > 0;
+
+    lk->blk_cap = o->blk_pool > 0 ? o->blk_pool : blk_cap_for(lk);
+
+    if (o->trace[dir])
+        trace_start(&lk->tx_trace, o->trace[dir]);
+    if (o->trace[!dir])
+        trace_start(&lk->rx_trace, o->trace[!dir]);
+
+    lk->timer = (struct TIMER *)malloc(sizeof(struct TIMER) * (lk->ntimer + 1 + WHEEL_LEVELS * WHEEL_SIZE + 2));
+    if (lk->timer == NULL)
+        ABORT("No enough memory");
 
-        time(&epoch);
+    lk->sock = (SOCKET)-1;
+    lk->epoll_fd = lk->timer_fd = -1;
+    lk->inform_phl_ready = 1;
+    rng_seed(&lk->tx_rng, o, lk->station - 'a', RNG_TRAFFIC);
+    rng_seed(&lk->rx_rng, o, 'b' - lk->station, RNG_TRAFFIC);
+    rng_seed(&lk->gap_rng, o, lk->station - 'a', RNG_GAP);
+    rng_seed(&lk->noise_rng, o, 'b' - lk->station, RNG_NOISE);
+    rng_seed(&lk->imp_rng, o, 'b' - lk->station, RNG_IMPAIR);
+    lk->ber_gap = -1;
+    if (o->ge.p > 0.0) {
+        lk->ber_log[0] = log1p(-o->ge.ber_good);
+        lk->ber_log[1] = log1p(-o->ge.ber_bad);
+        lk->ge_stay[0] = log1p(-o->ge.p);
+        lk->ge_stay[1] = log1p(-o->ge.r);
+        lk->noisy = 1;
+    } else if (o->ber > 0.0) {
+        lk->ber_log[0] = log1p(-o->ber);
+        lk->noisy = 1;
+    }
+    timer_init(lk);
+
+    return lk;
+}
+
+/*
+    Blocks of the delay line come from a pool of the receiving link. It is
+    carved out of chunks of BLK_GROW blocks as it grows, never beyond
+    blk_cap blocks, and recycled through a free list. The chunks are only
+    released by link_close().
+*/
+
+static void blk_grow(link_t *lk)
+{
+    struct BLK_CHUNK *chunk;
+    struct BLK *blk;
+    size_t stride = (sizeof(struct BLK) + blk_size + 15) & ~(size_t)15;
+    size_t head = (sizeof(struct BLK_CHUNK) + 15) & ~(size_t)15;
+    int i, n = lk->blk_cap - lk->blk_total < BLK_GROW ? lk->blk_cap - lk->blk_total : BLK_GROW;
+
+    chunk = (struct BLK_CHUNK *)malloc(head + n * stride);
+    if (chunk == NULL)
+        ABORT("No enough memory");
+    chunk->link = lk->blk_chunks;
+    lk->blk_chunks = chunk;
+
+    for (i = n - 1; i >= 0; i--) {
+        blk = (struct BLK *)((char *)chunk + head + i * stride);
+        blk->data = (unsigned char *)(blk + 1);
+        blk->link = lk->blk_free;
+        lk->blk_free = blk;
+    }
+    lk->blk_total += n;
+}
+
+/* a block for the delay line of lk, NULL if the pool is exhausted */
+static struct BLK *blk_alloc(link_t *lk)
+{
+    struct BLK *blk;
+
+    if (lk->blk_free == NULL) {
+        if (lk->blk_total >= lk->blk_cap) {
+            lk->blk_exhausted++;
+            return NULL;
+        }
+        blk_grow(lk);
+    }
+    blk = lk->blk_free;
+    lk->blk_free = blk->link;
+    if (++lk->blk_used > lk->blk_high)
+        lk->blk_high = lk->blk_used;
+    blk->rptr = blk->wptr = 0;
+
+    return blk;
+}
+
+static void blk_free(link_t *lk, struct BLK *blk)
+{
+    blk->link = lk->blk_free;
+    lk->blk_free = blk;
+    lk->blk_used--;
+}
+
+void link_close(link_t *lk)
+{
+    struct BLK_CHUNK *chunk;
+    struct RCV_FRAME *rf;
+
+    /* a pending block for the peer is out of its pool, one from the peer out of ours */
+    if (lk->peer) {
+        if (lk->tx_blk)
+            blk_free(lk->peer, lk->tx_blk);
+        lk->peer->tx_blk = NULL;
+        lk->peer->peer = NULL;
+    }
+    lk->tx_blk = NULL;
+#ifdef HAVE_IO_URING
+    if (lk->uring)
+        uring_close(lk->uring);
+#endif
+    lk->rblk_head = lk->rblk_tail = lk->blk_free = NULL;
+    lk->rx_next = lk->rx_due = RX_IDLE;
+    while ((chunk = lk->blk_chunks) != NULL) {
+        lk->blk_chunks = chunk->link;
+        free(chunk);
+    }
+    while ((rf = lk->rf_head) != NULL) {
+        lk->rf_head = rf->link;
+        free(rf);
+    }
+    while ((rf = lk->imp_head) != NULL) {
+        lk->imp_head = rf->link;
+        free(rf);
+    }
+    while ((rf = lk->imp_held) != NULL) {
+        lk->imp_held = rf->link;
+        free(rf);
+    }
+    while ((rf = lk->rf_free) != NULL) {
+        lk->rf_free = rf->link;
+        free(rf);
+    }
+    free(lk->rf_buf);
+    free(lk->rf_view);
+    sq_free(lk);
+    free(lk->timer);
+    free(lk);
+}
+
+void link_pair(link_t *a, link_t *b)
+{
+    a->peer = b;
+    b->peer = a;
+}
+
+void link_set_user(link_t *lk, void *user)
+{
+    lk->user = user;
+}
+
+void *link_user(link_t *lk)
+{
+    return lk->user;
+}
+
+int link_count(void)
+{
+    return nlinks;
+}
+
+link_t *link_get(int i)
+{
+    return i >= 0 && i < nlinks ? links[i] : NULL;
+}
+
+/* Create Communication Sockets  */
+
+void protocol_init(int argc, char **argv)
+{
+	SOCKET admin_sock, sock = (SOCKET)-1;
+	link_t *lk;
+	int i;
+    struct sockaddr_in name;
+
+	socket_init();
+	magic_init();
+	encoder_init();
+
+	config(argc, argv);
+
+    links = (link_t **)malloc(sizeof(link_t *) * 2 * mode_pairs);
+    if (links == NULL)
+        ABORT("No enough memory");
+
+    if (mode_simulate) {
+        if (mode_pairs > 1) {
+            /* keep thousands of links affordable */
+            opts.ntimer = ENGINE_NTIMER;
+            if (opts.sq_size == 0)
+                opts.sq_size = ENGINE_SQ_SIZE;
+        }
+        for (i = 0; i < mode_pairs; i++) {
+            opts.pair = i;
+            opts.station = 'a';
+            links[nlinks++] = link_open(&opts);
+            opts.station = 'b';
+            links[nlinks++] = link_open(&opts);
+            link_pair(links[nlinks - 2], links[nlinks - 1]);
+        }
+
+        if (mode_pairs == 1) {
+            for (i = 0; i < nlinks; i++) {
+                link_log_open(links[i]);
+                lprintf("Virtual clock starts at 0 ms\n");
+                lprintf("=================================================================\n\n");
+            }
+            link_select(links[0]);
+            return;
+        }
+
+        /* one log for the engine, the links themselves stay silent */
+        {
+            char fname[1040], title[64];
+
+            log_file = log_create(fname, ".log");
+            sprintf(title, "%d link pairs", mode_pairs);
+            log_banner(title, fname);
+            lprintf("Virtual clock starts at 0 ms\n");
+            lprintf("=================================================================\n\n");
+        }
+        return;
+    }
+
+    lk = links[nlinks++] = link_open(&opts);
+    link_log_open(lk);
+
+    if (lk->station == 'a') {
+
+        name.sin_family = AF_INET;
+        name.sin_addr.s_addr = INADDR_ANY;
+        name.sin_port = htons(port);
+
+        admin_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (admin_sock < 0)
+            ABORT("Create TCP socket");
+        if (bind(admin_sock, (struct sockaddr *)&name, sizeof(name)) < 0) {
+            lprintf("Station A: Failed to bind TCP port %u", port);
+            ABORT("Station A failed to bind TCP port");
+        }
+
+        listen(admin_sock, 5);
+
+        lprintf("Station A is waiting for station B on TCP port %u ... ", port);
+        fflush(stdout);
+
+        sock = accept(admin_sock, 0, 0);
+        if (sock < 0)
+            ABORT("Station A failed to communicate with station B");
+        lprintf("Done.\n");
+
+        recv(sock, (char *)&epoch, sizeof(epoch), 0);
+    }
+
+    if (lk->station == 'b') {
+
+        sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (sock < 0)
+            ABORT("Create TCP socket");
+
+        name.sin_family = AF_INET;
+        name.sin_addr.s_addr = inet_addr("127.0.0.1");
+        name.sin_port = htons((short)port);
+
+        for (i = 0; i < 60; i++) {
+            lprintf("Station B is connecting station A (TCP port %u) ... ", port);
+            fflush(stdout);
+
+            if (connect(sock, (struct sockaddr *)&name, sizeof(struct sockaddr_in)) < 0) {
+                lprintf("Failed!\n");
+                Sleep(2000);
+            } else {
+                lprintf("Done.\n");
+                break;
+            }
+        }
+        if (i == 6)
+            ABORT("Station B failed to connect station A");
+
+        time(&epoch);
         send(sock, (char *)&epoch, sizeof(epoch), 0);
     }
 
@@ -331,7 +1406,7 @@ void protocol_init(int argc, char **argv)
 
     /* socket options */
     {
-        int timeout_ms = 10; 
+        int timeout_ms = 10;
         int buf_size = 1024 * 64;
         int on = 1;
 
@@ -341,553 +1416,2914 @@ void protocol_init(int argc, char **argv)
         setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char *)&buf_size, sizeof(int));
         setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (char *)&buf_size, sizeof(int));
 
-        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));   
-    }   
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));
+    }
+
+    lk->sock = sock;
+
+    if (mode_uring) {
+#ifdef HAVE_IO_URING
+        if (uring_open(lk) == 0)
+            lprintf("TCP channel: io_uring, multishot receive, %s send\n",
+                lk->uring->fixed_send ? "registered buffer" : "plain");
+        else
+            lprintf("TCP channel: io_uring unavailable (%s), using send()/recv()\n", strerror(errno));
+#else
+        lprintf("TCP channel: io_uring not supported by this build, using send()/recv()\n");
+#endif
+    }
+
+    if (mode_zerocopy && lk->uring == NULL) {
+#ifdef HAVE_ZEROCOPY
+        int on = 1;
+
+        if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, (char *)&on, sizeof(on)) == 0) {
+            lk->zerocopy = 1;
+            lprintf("TCP channel: MSG_ZEROCOPY for sends of %d bytes or more\n", ZEROCOPY_MIN);
+        } else
+            lprintf("TCP channel: MSG_ZEROCOPY unavailable (%s)\n", strerror(errno));
+#else
+        lprintf("TCP channel: MSG_ZEROCOPY not supported by this build\n");
+#endif
+    }
+
+    wait_init(lk);
+
+    get_ms();
+}
+
+/* Physical Layer: Sender */
+
+#define EVENT_BATCH   64 /* events per poll_events() in link_run() */
+
+/* positions stay in 0 ~ sq_size-1, n is never more than sq_size */
+#define sq_inc(lk, p, n) ((p) += (n), (p) >= (lk)->sq_size ? (p) -= (lk)->sq_size : 0)
+/* bytes contiguous in memory from position p on */
+#define sq_span(lk, p) ((lk)->sq_mirror ? (lk)->sq_size : (lk)->sq_size - (p))
+
+/*
+    The sending queue is a memfd mapped twice back to back where available:
+    byte i and byte i + sq_size are the same memory, so a frame or a send
+    starting anywhere in the queue is one piece. The size is rounded up to
+    whole pages. Elsewhere it is plain memory written and read in two
+    pieces when it wraps.
+*/
+static void sq_alloc(link_t *lk, int size)
+{
+#ifdef HAVE_MEMFD
+    long page = sysconf(_SC_PAGESIZE);
+    unsigned char *base;
+    int fd;
+
+    size = (int)((size + page - 1) / page * page);
+    fd = memfd_create("sq", MFD_CLOEXEC);
+    if (fd >= 0 && ftruncate(fd, size) == 0) {
+        base = (unsigned char *)mmap(NULL, 2 * (size_t)size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base != MAP_FAILED) {
+            if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED &&
+                mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED) {
+                close(fd);
+                lk->sq = base;
+                lk->sq_size = size;
+                lk->sq_mirror = 1;
+                return;
+            }
+            munmap(base, 2 * (size_t)size);
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+#endif
+    lk->sq = (unsigned char *)malloc(size);
+    if (lk->sq == NULL)
+        ABORT("No enough memory");
+    lk->sq_size = size;
+    lk->sq_mirror = 0;
+}
+
+static void sq_free(link_t *lk)
+{
+#ifdef HAVE_MEMFD
+    if (lk->sq_mirror) {
+        munmap(lk->sq, 2 * (size_t)lk->sq_size);
+        return;
+    }
+#endif
+    free(lk->sq);
+}
+
+#define HDLC_FLAG 0x7e
+#define HDLC_ESC  0x7d
+
+static void blk_commit(link_t *lk, struct BLK *blk, int ts);
+
+/* Hand the bytes sent at lk->now to the peer's delay line */
+static void peer_flush(link_t *lk)
+{
+    struct BLK *blk = lk->tx_blk;
+
+    if (blk == NULL)
+        return;
+    lk->tx_blk = NULL;
+
+    if (lk->peer == NULL)
+        return;
+    link_select(lk->peer);
+    blk_commit(lk->peer, blk, blk->commit_ts);
+    link_select(lk);
+}
+
+static int phl_send(link_t *lk, const unsigned char *buf, int len)
+{
+    int n, sent;
+
+    if (lk->peer == NULL)
+        return send(lk->sock, (const char *)buf, len, 0);
+
+    for (sent = 0; sent < len; sent += n) {
+        if (lk->tx_blk && (lk->tx_blk->commit_ts != lk->now || lk->tx_blk->wptr == blk_size))
+            peer_flush(lk);
+        if (lk->tx_blk == NULL) {
+            /* the receiver is overrun, the rest is lost on the line */
+            if ((lk->tx_blk = blk_alloc(lk->peer)) == NULL) {
+                lk->peer->blk_dropped += len - sent;
+                break;
+            }
+            lk->tx_blk->commit_ts = lk->now;
+        }
+        n = blk_size - lk->tx_blk->wptr;
+        if (n > len - sent)
+            n = len - sent;
+        memcpy(lk->tx_blk->data + lk->tx_blk->wptr, buf + sent, n);
+        lk->tx_blk->wptr += n;
+    }
+
+    return len;
+}
+
+static int sq_len(link_t *lk)
+{
+    int n = lk->sq_tail - lk->sq_head;
+
+    return n < 0 ? n + lk->sq_size : n;
+}
+
+int link_phl_sq_len(link_t *lk)
+{
+    return sq_len(lk);
+}
+
+#ifdef HAVE_ZEROCOPY
+/* Retire the zerocopy sends the kernel is done with, their bytes of sq may be reused */
+static void zc_reap(link_t *lk)
+{
+    char control[256];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+    unsigned int id;
+
+    while (lk->zc_done != lk->zc_sent) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(lk->sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            /* sends ee_info ~ ee_data are done, not necessarily in order */
+            for (id = serr->ee_info; id - lk->zc_done < ZC_INFLIGHT; id++) {
+                lk->zc_complete[id % ZC_INFLIGHT] = 1;
+                if (id == serr->ee_data)
+                    break;
+            }
+        }
+
+        while (lk->zc_done != lk->zc_sent && lk->zc_complete[lk->zc_done % ZC_INFLIGHT]) {
+            lk->zc_complete[lk->zc_done % ZC_INFLIGHT] = 0;
+            lk->zc_done++;
+        }
+    }
+}
+#endif
+
+/* bytes of the sending queue in use: queued, or still read by a zerocopy send */
+static int sq_used(link_t *lk)
+{
+#ifdef HAVE_ZEROCOPY
+    int n;
+
+    if (lk->zc_done != lk->zc_sent) {
+        n = lk->sq_tail - lk->zc_start[lk->zc_done % ZC_INFLIGHT];
+        return n < 0 ? n + lk->sq_size : n;
+    }
+#endif
+    return sq_len(lk);
+}
+
+/* send len1 bytes at sq_head and len2 bytes at the start of the queue in one call */
+static int socket_sendv(link_t *lk, int len1, int len2)
+{
+    int ret;
+#ifdef _WIN32
+    ret = send(lk->sock, (const char *)&lk->sq[lk->sq_head], len1, 0);
+    if (ret == len1 && len2 > 0 && (ret = send(lk->sock, (const char *)lk->sq, len2, 0)) > 0)
+        ret += len1;
+#else
+    struct iovec iov[2];
+    struct msghdr msg;
+    int flags = 0;
+
+    iov[0].iov_base = &lk->sq[lk->sq_head];
+    iov[0].iov_len = len1;
+    iov[1].iov_base = lk->sq;
+    iov[1].iov_len = len2;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = len2 > 0 ? 2 : 1;
+
+#ifdef HAVE_ZEROCOPY
+    if (lk->zerocopy && len1 + len2 >= ZEROCOPY_MIN && lk->zc_sent - lk->zc_done < ZC_INFLIGHT)
+        flags = MSG_ZEROCOPY;
+#endif
+    ret = sendmsg(lk->sock, &msg, flags);
+#ifdef HAVE_ZEROCOPY
+    if (flags && ret > 0)
+        lk->zc_start[lk->zc_sent++ % ZC_INFLIGHT] = lk->sq_head;
+#endif
+#endif
+    return ret;
+}
+
+/* send up to n bytes off the head of the sending queue, a wrapped queue in one call too */
+static int sq_send(link_t *lk, int n)
+{
+    int len1, send_bytes;
+
+    if (n > sq_len(lk))
+        n = sq_len(lk);
+    if (n <= 0)
+        return 0;
+
+    len1 = sq_span(lk, lk->sq_head); /* up to the end of the queue */
+    if (len1 > n)
+        len1 = n;
+
+    if (lk->peer)
+        send_bytes = phl_send(lk, &lk->sq[lk->sq_head], len1) + phl_send(lk, lk->sq, n - len1);
+    else
+        send_bytes = socket_sendv(lk, len1, n - len1);
+    if (send_bytes <= 0) {
+        lprintf("TCP Disconnected.\n");
+        exit(0);
+    }
+
+    sq_inc(lk, lk->sq_head, send_bytes);
+
+    return send_bytes;
+}
+
+/*
+    Frame encoding: 0xff, then every byte as its low and its high nibble,
+    then 0xff again. A frame is expanded straight into the sending queue,
+    in one piece or two if it wraps around the end.
+
+    HDLC framing puts the frame between 0x7e flags instead, a 0x7e or 0x7d
+    byte inside is sent as 0x7d followed by the byte ^ 0x20.
+*/
+
+static int cpu_avx2;
+
+static void encoder_init(void)
+{
+#if defined(__AVX2__)
+    cpu_avx2 = 1;
+#elif defined(HAVE_AVX2)
+    __builtin_cpu_init();
+    cpu_avx2 = __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+#ifdef HAVE_AVX2
+/* returns the number of bytes encoded, a multiple of 32 */
+AVX2_TARGET static int nibble_encode_avx2(unsigned char *dst, const unsigned char *src, int len)
+{
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    __m256i v, lo, hi, a, b;
+    int i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *)(src + i));
+        lo = _mm256_and_si256(v, mask);
+        hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask);
+        /* unpack works per 128-bit lane: a = bytes 0-7, 16-23; b = 8-15, 24-31 */
+        a = _mm256_unpacklo_epi8(lo, hi);
+        b = _mm256_unpackhi_epi8(lo, hi);
+        _mm256_storeu_si256((__m256i *)(dst + 2 * i), _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + 2 * i + 32), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+
+    return i;
+}
+#endif
+
+#ifdef HAVE_SSE2
+/* returns the number of bytes encoded, a multiple of 16 */
+static int nibble_encode_sse2(unsigned char *dst, const unsigned char *src, int len)
+{
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    __m128i v, lo, hi;
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(src + i));
+        lo = _mm_and_si128(v, mask);
+        hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+        _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_unpacklo_epi8(lo, hi));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i + 16), _mm_unpackhi_epi8(lo, hi));
+    }
+
+    return i;
+}
+#endif
+
+/* src[0..len) to dst[0..2*len), low nibble first */
+static void nibble_encode(unsigned char *dst, const unsigned char *src, int len)
+{
+    int i = 0;
+
+#ifdef HAVE_AVX2
+    if (cpu_avx2)
+        i = nibble_encode_avx2(dst, src, len);
+#endif
+#ifdef HAVE_SSE2
+    i += nibble_encode_sse2(dst + 2 * i, src + i, len - i);
+#endif
+    for (; i < len; i++) {
+        dst[2 * i] = src[i] & 0x0f;
+        dst[2 * i + 1] = src[i] >> 4;
+    }
+}
+
+/* append len bytes as 2 * len nibbles to the sending queue */
+static void sq_put_nibbles(link_t *lk, const unsigned char *src, int len)
+{
+    unsigned char *sq = lk->sq, *p;
+    int tail = lk->sq_tail, room = sq_span(lk, tail), k;
+
+    if (2 * len <= room)
+        nibble_encode(sq + tail, src, len);
+    else {
+        /* whole bytes up to the end of the queue, the rest from its start */
+        k = room / 2;
+        nibble_encode(sq + tail, src, k);
+        p = sq;
+        if (room % 2) { /* a byte split across the end */
+            sq[lk->sq_size - 1] = src[k] & 0x0f;
+            *p++ = src[k] >> 4;
+            k++;
+        }
+        nibble_encode(p, src + k, len - k);
+    }
+
+    sq_inc(lk, lk->sq_tail, 2 * len);
+}
+
+/* append n bytes to the sending queue, in at most two pieces */
+static void sq_write(link_t *lk, const unsigned char *buf, int n)
+{
+    int room = sq_span(lk, lk->sq_tail);
+
+    if (n <= room)
+        memcpy(lk->sq + lk->sq_tail, buf, n);
+    else {
+        memcpy(lk->sq + lk->sq_tail, buf, room);
+        memcpy(lk->sq, buf + room, n - room);
+    }
+    sq_inc(lk, lk->sq_tail, n);
+}
+
+/* append the encoded frame made of the pieces iov[0..iovcnt) */
+static void sq_put_frame(link_t *lk, const struct iovec *iov, int iovcnt)
+{
+    static const unsigned char flag = 0xff;
+    int i;
+
+    sq_write(lk, &flag, 1);
+    for (i = 0; i < iovcnt; i++)
+        sq_put_nibbles(lk, (const unsigned char *)iov[i].iov_base, (int)iov[i].iov_len);
+    sq_write(lk, &flag, 1);
+}
+
+#define hdlc_special(ch) ((ch) == HDLC_FLAG || (ch) == HDLC_ESC)
+
+/* append the byte-stuffed frame, runs of plain bytes are copied as a whole */
+static void sq_put_hdlc(link_t *lk, const struct iovec *iov, int iovcnt)
+{
+    static const unsigned char flag = HDLC_FLAG;
+    const unsigned char *frame;
+    unsigned char esc[2];
+    int i, k, len, run;
+
+    sq_write(lk, &flag, 1);
+    for (k = 0; k < iovcnt; k++) {
+        frame = (const unsigned char *)iov[k].iov_base;
+        len = (int)iov[k].iov_len;
+        for (run = i = 0; i < len; i++) {
+            if (hdlc_special(frame[i])) {
+                sq_write(lk, frame + run, i - run);
+                esc[0] = HDLC_ESC;
+                esc[1] = frame[i] ^ 0x20;
+                sq_write(lk, esc, 2);
+                run = i + 1;
+            }
+        }
+        sq_write(lk, frame + run, len - run);
+    }
+    sq_write(lk, &flag, 1);
+}
+
+/*
+    Channel trace: rows of "<time> <ber> <delay> [<rate>]", the time in
+    seconds from the start, the delay in ms and the rate in bits/s (k, M
+    and G allowed), separated by blanks or commas; '#' starts a comment.
+    Each row holds from its time until the next one, the command line
+    values before the first. The receiver follows the BER, the delay and
+    the rate of the direction into it, the transmitter the rate out of it.
+
+    The file is mapped, not read: rows are parsed one ahead of the clock,
+    so a trace of hours costs nothing up front and only the pages passed
+    are touched. Every link keeps its own position in the shared mapping.
+*/
+
+static struct trace_map {
+    const char *name;
+    const char *data;
+    size_t size;
+} trace_maps[2];
+
+static void trace_fail(const char *name, int line, const char *why)
+{
+    char msg[1400];
+
+    if (line > 0)
+        sprintf(msg, "Channel trace \"%.1024s\" line %d: %s", name, line, why);
+    else
+        sprintf(msg, "Channel trace \"%.1024s\": %s", name, why);
+    ABORT(msg);
+}
+
+static const struct trace_map *trace_map(const char *name)
+{
+    struct trace_map *m;
+    int i;
+
+    for (i = 0; i < 2 && trace_maps[i].name; i++)
+        if (strcmp(trace_maps[i].name, name) == 0)
+            return &trace_maps[i];
+    m = &trace_maps[i];
+    m->name = name;
+
+#ifdef _WIN32
+    {
+        HANDLE f, h;
+        LARGE_INTEGER size;
+
+        f = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (f == INVALID_HANDLE_VALUE || !GetFileSizeEx(f, &size))
+            trace_fail(name, 0, "cannot open the file");
+        if (size.QuadPart > 0) {
+            h = CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (h == NULL || (m->data = (const char *)MapViewOfFile(h, FILE_MAP_READ, 0, 0, 0)) == NULL)
+                trace_fail(name, 0, "cannot map the file");
+            CloseHandle(h);
+        }
+        m->size = (size_t)size.QuadPart;
+        CloseHandle(f);
+    }
+#else
+    {
+        struct stat st;
+        void *p;
+        int fd;
+
+        if ((fd = open(name, O_RDONLY)) < 0 || fstat(fd, &st) != 0)
+            trace_fail(name, 0, strerror(errno));
+        if (st.st_size > 0) {
+            p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED)
+                trace_fail(name, 0, strerror(errno));
+#ifdef MADV_SEQUENTIAL
+            madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+            m->data = (const char *)p;
+        }
+        m->size = (size_t)st.st_size;
+        close(fd);
+    }
+#endif
+
+    return m;
+}
+
+/* read the next row ahead */
+static void trace_next(struct trace_cur *c)
+{
+    const struct trace_map *m = c->map;
+    char row[256], rate[64], *q;
+    double t;
+    int n, k;
+
+    while (c->pos < m->size) {
+        for (n = 0; c->pos < m->size && m->data[c->pos] != '\n'; c->pos++)
+            if (n < (int)sizeof(row) - 1)
+                row[n++] = m->data[c->pos] == ',' ? ' ' : m->data[c->pos];
+        row[n] = 0;
+        c->pos++;
+        c->line++;
+        if ((q = strchr(row, '#')) != NULL)
+            *q = 0;
+
+        rate[0] = 0;
+        k = sscanf(row, "%lf %lf %d %63s", &t, &c->ber, &c->delay, rate);
+        if (k <= 0)
+            continue; /* a blank line or a comment */
+        if (k < 3)
+            trace_fail(m->name, c->line, "time, BER and delay expected");
+        if (t < 0 || t * 1000 < c->due || t * 1000 > 0x7fffff00)
+            trace_fail(m->name, c->line, "time out of order");
+        if (c->ber < 0.0 || c->ber >= 1.0)
+            trace_fail(m->name, c->line, "bad BER");
+        if (c->delay < 11 || c->delay > 60000)
+            trace_fail(m->name, c->line, "bad delay (11 ~ 60000 ms)");
+        c->bps = k == 4 ? parse_rate(rate) : 0;
+        if (k == 4 && (c->bps < 100 || c->bps > 100000000000LL))
+            trace_fail(m->name, c->line, "bad rate (100 ~ 100G)");
+        c->due = (int)(t * 1000 + 0.5);
+        return;
+    }
+    c->due = INT_MAX;
+}
+
+static void trace_start(struct trace_cur *c, const char *name)
+{
+    c->map = trace_map(name);
+    c->pos = 0;
+    c->line = 0;
+    c->due = 0;
+    trace_next(c);
+}
+
+/* the transmitter takes the rate of the rows due by now */
+static void trace_tx(link_t *lk)
+{
+    struct trace_cur *c = &lk->tx_trace;
+
+    for (; c->due <= lk->now; trace_next(c)) {
+        if (c->bps > 0 && c->bps != lk->tx_bps) {
+            lk->tx_bps = c->bps;
+            lk->fill_ns = lk->burst * 8000000000LL / (lk->tx_bps * lk->wire) + 1;
+        }
+    }
+}
+
+/* the receiver takes the rows due by 'ts' */
+static void trace_rx(link_t *lk, int ts)
+{
+    struct trace_cur *c = &lk->rx_trace;
+
+    for (; c->due <= ts; trace_next(c)) {
+        if (lk->opts.ge.p <= 0.0 && log1p(-c->ber) != lk->ber_log[0]) {
+            lk->ber_log[0] = log1p(-c->ber);
+            lk->noisy = c->ber > 0.0;
+            lk->ber_gap = -1; /* drawn again at the new rate */
+        }
+        lk->rx_delay = c->delay;
+        if (c->bps > 0)
+            lk->rx_bps = c->bps;
+        if (lk->opts.blk_pool <= 0 && blk_cap_for(lk) > lk->blk_cap)
+            lk->blk_cap = blk_cap_for(lk);
+        dbg_warning("Channel trace line %d: BER %.1E, delay %d ms, %lld bps\n", c->line, c->ber, lk->rx_delay, lk->rx_bps);
+    }
+}
+
+/*
+    Token-bucket pacer. Tokens are bytes on the wire, earned at the line rate
+    from a nanosecond clock (the virtual clock when simulating). The bits*ns
+    not yet making a whole byte are carried over, so slow lines neither stall
+    nor drift. The bucket holds 'burst' bytes; credit beyond it is lost.
+*/
+
+static long long pacer_clock(link_t *lk)
+{
+    return mode_simulate ? lk->now * 1000000LL : mono_ns();
+}
+
+static void pacer_refill(link_t *lk)
+{
+    long long t = pacer_clock(lk), dt = t - lk->pace_ns, busy;
+
+    if (lk->pace_ns < 0 || dt <= 0) {
+        if (lk->pace_ns < 0)
+            lk->pace_ns = t;
+        return;
+    }
+    lk->pace_ns = t;
+    if (lk->backlog) {
+        /* busy at most as long as the queued bytes take on the line */
+        busy = (long long)(sq_len(lk) * 8e9 / ((double)lk->tx_bps * lk->wire));
+        if (busy > dt)
+            busy = dt;
+        lk->busy_ns += busy;
+        lk->busy_bits += busy * 1e-9 * lk->tx_bps;
+    }
+    if (lk->tx_trace.map)
+        trace_tx(lk);
+
+    if (dt > lk->fill_ns) /* a full bucket earns nothing more */
+        dt = lk->fill_ns;
+    lk->token_rem += dt * lk->tx_bps * lk->wire;
+    lk->tokens += lk->token_rem / 8000000000LL;
+    lk->token_rem %= 8000000000LL;
+    if (lk->tokens >= lk->burst) {
+        lk->tokens = lk->burst;
+        lk->token_rem = 0;
+    }
+}
+
+static void pacer_spend(link_t *lk, int n)
+{
+    lk->tokens -= n;
+    if (lk->backlog)
+        lk->busy_bytes += n;
+    lk->backlog = sq_len(lk) > 0;
+}
+
+/* bytes the pacer allows now, up to what is queued */
+static int pacer_allow(link_t *lk)
+{
+    int n = sq_len(lk);
+
+    return n < lk->tokens ? n : (int)lk->tokens;
+}
+
+/* ms until the bucket holds the queued bytes, or is full if they are more */
+static int pacer_due(link_t *lk)
+{
+    long long need = sq_len(lk), rate = lk->tx_bps * lk->wire, ns;
+
+    if (need > lk->burst)
+        need = lk->burst;
+    if (lk->pace_ns < 0 || lk->tokens >= need)
+        return 0;
+    ns = ((need - lk->tokens) * 8000000000LL - lk->token_rem + rate - 1) / rate;
+    ns -= pacer_clock(lk) - lk->pace_ns; /* earned since the last refill */
+
+    return ns > 0 ? (int)((ns + 999999) / 1000000) : 0;
+}
+
+static void blk_report(link_t *lk)
+{
+    if (lk->blk_exhausted == 0)
+        lprintf("Receive blocks: %d of %d in use at most, %d bytes each\n", lk->blk_high, lk->blk_cap, blk_size);
+    else
+        lprintf("Receive blocks: %d of %d in use at most, pool exhausted %llu times, %llu bytes dropped\n",
+            lk->blk_high, lk->blk_cap, lk->blk_exhausted, lk->blk_dropped);
+}
+
+/* configured line rate over the time with a backlog, on average if a trace changed it */
+static double pacer_line_rate(link_t *lk)
+{
+    return lk->tx_trace.map ? lk->busy_bits * 1e9 / lk->busy_ns : (double)lk->tx_bps;
+}
+
+static void pacer_report(link_t *lk)
+{
+    double achieved;
+
+    if (lk->busy_ns <= 0)
+        return;
+    achieved = lk->busy_bytes * 8e9 / lk->wire / lk->busy_ns;
+    lprintf("Line rate: %.0f bps achieved of %.0f bps configured (%.3f%%) in %.3f s with a backlog\n",
+        achieved, pacer_line_rate(lk), achieved * 100 / pacer_line_rate(lk), lk->busy_ns / 1e9);
+}
+
+void link_send_frame_iov(link_t *lk, const struct iovec *iov, int iovcnt)
+{
+    const unsigned char *p;
+    int idle = lk->sq_head == lk->sq_tail, i, k, len = 0, n = 2;
+
+    lk->inform_phl_ready = 1;
+
+    for (k = 0; k < iovcnt; k++) {
+        len += (int)iov[k].iov_len;
+        if (lk->opts.framing == FRAMING_HDLC) {
+            for (p = (const unsigned char *)iov[k].iov_base, i = 0; i < (int)iov[k].iov_len; i++)
+                n += hdlc_special(p[i]);
+        }
+    }
+    n += lk->opts.framing == FRAMING_HDLC ? len : 2 * len;
+
+#ifdef HAVE_ZEROCOPY
+    if (lk->zerocopy && sq_used(lk) + n > lk->sq_size - 1)
+        zc_reap(lk);
+#endif
+    if (sq_used(lk) + n > lk->sq_size - 1)
+        ABORT("Physical Layer Sending Queue overflow");
+
+    if (lk->opts.framing == FRAMING_HDLC)
+        sq_put_hdlc(lk, iov, iovcnt);
+    else
+        sq_put_frame(lk, iov, iovcnt);
+
+    /* an idle channel sends what the pacer still allows at once, in one go */
+    if (idle && lk->uring == NULL) {
+        pacer_refill(lk);
+        pacer_spend(lk, sq_send(lk, pacer_allow(lk)));
+    }
+
+    if (lk->batch_n > 0 && sq_len(lk) >= lk->sq_level)
+        batch_cancel(lk, PHYSICAL_LAYER_READY, 0);
+}
+
+void link_send_frame(link_t *lk, unsigned char *frame, int len)
+{
+    struct iovec iov;
+
+    iov.iov_base = frame;
+    iov.iov_len = len;
+    link_send_frame_iov(lk, &iov, 1);
+}
+
+static void socket_send(link_t *lk)
+{
+    int n;
+
+    if (lk->send_ts == 0)
+        lk->send_ts = lk->now;
+
+    if (lk->now <= lk->send_ts)
+        return;
+
+    pacer_refill(lk);
+    n = pacer_allow(lk);
+
+#ifdef HAVE_IO_URING
+    if (lk->uring) {
+        /* one batch in flight, the tokens keep growing meanwhile */
+        if (lk->uring->sending)
+            return;
+        if (n > 0)
+            uring_send(lk, n);
+        lk->uring->send_busy = lk->backlog;
+        lk->tokens -= n; /* what does not go out is given back on completion */
+        if (lk->backlog)
+            lk->busy_bytes += n;
+        lk->backlog = sq_len(lk) > n;
+        lk->send_ts = lk->now;
+        return;
+    }
+#endif
+
+    pacer_spend(lk, sq_send(lk, n));
+    lk->send_ts = lk->now;
+}
+
+/* Physical Layer: Receiver */
+
+/*
+    Noise: every bit of data on the line is in error with probability ber,
+    independently of the others. Rather than drawing for each bit or each
+    block, the number of good bits before the next error is drawn from the
+    geometric distribution, floor(log(u) / log(1 - ber)) for u uniform in
+    (0, 1], so the cost is one draw per error. A bit of data is one of the
+    low 4 bits of a nibble, or any bit of a byte with HDLC framing.
+
+    With --gilbert the line alternates between a good and a bad state of
+    BERs of their own, leaving the good state with probability p per bit
+    and the bad one with r (Gilbert-Elliott). The time spent in a state is
+    geometric as well, so a state change costs one more draw and the errors
+    come in bursts of 1 / r bits on average, p / (p + r) of the time.
+*/
+
+#define GEO_NEVER 4000000000000000000LL
+
+/* failures before the first success, log_q = log(1 - probability of success) */
+static long long geo_skip(link_t *lk, double log_q)
+{
+    double u, gap;
+
+    if (log_q == 0.0)
+        return GEO_NEVER;
+    u = 1.0 - rng_unit(&lk->noise_rng); /* (0, 1] */
+    gap = floor(log(u) / log_q);
+
+    return gap < GEO_NEVER ? (long long)gap : GEO_NEVER;
+}
+
+/* enter a state, 'bad' or not */
+static void ge_enter(link_t *lk, int bad)
+{
+    lk->ge_bad = bad;
+    lk->ge_left = lk->opts.ge.p > 0.0 ? 1 + geo_skip(lk, lk->ge_stay[bad]) : GEO_NEVER;
+    lk->ber_gap = geo_skip(lk, lk->ber_log[bad]);
+    lk->ge_bursts += bad;
+}
+
+/* flip the bits of the block that the noise hits */
+static void ber_apply(link_t *lk, struct BLK *blk)
+{
+    int shift = lk->wire == 2 ? 2 : 3; /* log2 of the bits of data in a byte */
+    long long bits = (long long)blk->wptr << shift, pos = 0, n, e;
+    double p = lk->opts.ge.p;
+
+    /* the first state as in the long run */
+    if (lk->ber_gap < 0)
+        ge_enter(lk, p > 0.0 && rng_unit(&lk->noise_rng) < p / (p + lk->opts.ge.r));
+
+    while (pos < bits) {
+        n = bits - pos < lk->ge_left ? bits - pos : lk->ge_left;
+        for (e = lk->ber_gap; e < n; e += geo_skip(lk, lk->ber_log[lk->ge_bad]) + 1) {
+            blk->data[(pos + e) >> shift] ^= 1 << ((pos + e) & ((1 << shift) - 1));
+            lk->noise++;
+            lk->ge_errors[lk->ge_bad]++;
+            dbg_warning("Impose noise on received data, %llu/%llu=%.1E\n", lk->noise, lk->nbits, (double)lk->noise / lk->nbits);
+        }
+        lk->ber_gap = e - n;
+        lk->ge_bits[lk->ge_bad] += n;
+        pos += n;
+        if ((lk->ge_left -= n) == 0)
+            ge_enter(lk, !lk->ge_bad);
+    }
+}
+
+static void ge_report(link_t *lk)
+{
+    unsigned long long bits = lk->ge_bits[0] + lk->ge_bits[1];
+
+    if (lk->opts.ge.p <= 0.0 || bits == 0)
+        return;
+    lprintf("Burst errors: %.3f%% of %llu bits in the bad state, %llu bursts of %.0f bits on average, BER %.1E good, %.1E bad\n",
+        lk->ge_bits[1] * 100.0 / bits, bits, lk->ge_bursts, lk->ge_bursts ? (double)lk->ge_bits[1] / lk->ge_bursts : 0.0,
+        lk->ge_bits[0] ? (double)lk->ge_errors[0] / lk->ge_bits[0] : 0.0,
+        lk->ge_bits[1] ? (double)lk->ge_errors[1] / lk->ge_bits[1] : 0.0);
+}
+
+
+/*
+    Delay line: the bytes of a block handed to the channel at 'ts' go on
+    the line one after the other at the line rate, once the bytes before
+    them are through, and each arrives the propagation delay later. The
+    receiver decodes them as they arrive and wakes up when a frame's
+    closing delimiter does, however the bytes were chunked on their way.
+*/
+
+/* arrival of byte i of a block (ns) */
+#define blk_arrival(lk, blk, i) ((blk)->arrive_ns + (i) * 8000000000LL / ((blk)->bps * (lk)->wire))
+
+static void rx_schedule(link_t *lk);
+
+/* Impose noise on a received block and append it to the delay line */
+static void blk_commit(link_t *lk, struct BLK *blk, int ts)
+{
+    if (lk->rx_trace.map)
+        trace_rx(lk, ts);
+
+    lk->nbits += (unsigned int)blk->wptr * 8 / lk->wire;
+
+    if (lk->noisy)
+        ber_apply(lk, blk);
+
+    if (lk->rx_clock < ts * 1000000LL)
+        lk->rx_clock = ts * 1000000LL;
+    blk->commit_ts = ts;
+    blk->bps = lk->rx_bps;
+    blk->arrive_ns = lk->rx_clock + lk->rx_delay * 1000000LL;
+    if (blk->arrive_ns < lk->rx_last) /* a shorter delay, the line still keeps the order */
+        blk->arrive_ns = lk->rx_last;
+    lk->rx_clock += (long long)blk->wptr * 8000000000LL / (lk->rx_bps * lk->wire);
+    lk->rx_last = blk_arrival(lk, blk, blk->wptr);
+    blk->link = NULL;
+
+    if (lk->rblk_head == NULL)
+        lk->rblk_head = lk->rblk_tail = blk;
+    else {
+        lk->rblk_tail->link = blk;
+        lk->rblk_tail = blk;
+    }
+    if (lk->rx_next == RX_IDLE)
+        rx_schedule(lk);
+}
+
+static void socket_recv(link_t *lk)
+{
+    struct BLK *blk = blk_alloc(lk);
+    char junk[4096];
+    int flags = 0, n;
+
+#ifdef HAVE_ZEROCOPY
+    /* select() also reports the socket readable for completions on its error queue */
+    if (lk->zerocopy)
+        flags = MSG_DONTWAIT;
+#endif
+    /* with the pool exhausted the data is read and lost, as by an overrun receiver */
+    if (blk)
+        n = recv(lk->sock, (char *)blk->data, blk_size, flags);
+    else
+        n = recv(lk->sock, junk, sizeof(junk), flags);
+#ifdef HAVE_ZEROCOPY
+    if (n < 0 && flags && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        if (blk)
+            blk_free(lk, blk);
+        zc_reap(lk);
+        return;
+    }
+#endif
+    if (n <= 0) {
+        lprintf("TCP disconnected.\n");
+        exit(0);
+    }
+
+    if (blk == NULL) {
+        lk->blk_dropped += n;
+        return;
+    }
+    blk->wptr = n;
+    blk_commit(lk, blk, lk->now);
+}
+
+#ifdef HAVE_IO_URING
+
+/*
+    io_uring transport: one multishot receive drains the socket into a ring
+    of provided buffers, and the segments of the sending queue due in a tick
+    go out as linked sends in a single io_uring_enter(). The sending queue
+    is registered as fixed buffer 0, kernels without fixed-buffer send (a
+    probe at setup tells) fall back to plain sends, kernels without
+    multishot receive to re-armed single receives. The ring fd replaces the
+    socket in the epoll set. The pacer is charged when a batch is queued
+    and refunded what a completion did not send.
+*/
+
+static struct io_uring_sqe *uring_sqe(struct uring *u)
+{
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    if (u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= *u->sq_entries)
+        ABORT("io_uring submission queue overflow");
+
+    idx = u->sqe_tail++ & *u->sq_mask;
+    u->sq_array[idx] = idx;
+    u->to_submit++;
+
+    sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void uring_submit(struct uring *u)
+{
+    if (u->to_submit == 0)
+        return;
+
+    __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+    while (syscall(__NR_io_uring_enter, u->fd, u->to_submit, 0, 0, NULL, 0) < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            ABORT("system io_uring_enter()");
+    }
+    u->to_submit = 0;
+}
+
+static void uring_put_buf(struct uring *u, int bid)
+{
+    struct io_uring_buf *buf = &u->br->bufs[u->br_tail++ & (URING_NBUF - 1)];
+
+    buf->addr = (unsigned long)(u->bufs + bid * blk_size);
+    buf->len = blk_size;
+    buf->bid = (unsigned short)bid;
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_arm_recv(link_t *lk)
+{
+    struct uring *u = lk->uring;
+    struct io_uring_sqe *sqe = uring_sqe(u);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = lk->sock;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->ioprio = u->multishot ? IORING_RECV_MULTISHOT : 0;
+    sqe->user_data = UD_RECV;
+    u->recv_armed = 1;
+}
+
+static void uring_close(struct uring *u)
+{
+    if (u->fd >= 0)
+        close(u->fd);
+    if (u->sqes && u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_sz);
+    if (u->cq_ptr && u->cq_ptr != MAP_FAILED && u->cq_ptr != u->sq_ptr)
+        munmap(u->cq_ptr, u->cq_sz);
+    if (u->sq_ptr && u->sq_ptr != MAP_FAILED)
+        munmap(u->sq_ptr, u->sq_sz);
+    if (u->br && u->br != MAP_FAILED)
+        munmap(u->br, URING_NBUF * sizeof(struct io_uring_buf));
+    free(u->bufs);
+    free(u);
+}
+
+/*
+    Fixed-buffer sends came later than fixed-buffer registration and have
+    no feature flag, a kernel without them fails the send with -EINVAL. A
+    zero-length send from buffer 0 tells, before any data is at stake.
+*/
+static int uring_probe_fixed_send(struct uring *u, SOCKET sock, unsigned char *buf)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    unsigned head = *u->cq_head;
+    int res;
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = sock;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = 0;
+    sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+    sqe->buf_index = 0;
+    sqe->user_data = UD_SEND;
+    uring_submit(u);
+
+    while (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (syscall(__NR_io_uring_enter, u->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+            return 0;
+    }
+    res = u->cqes[head & *u->cq_mask].res;
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return res >= 0;
+}
+
+static int uring_open(link_t *lk)
+{
+    struct uring *u;
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    struct iovec iov;
+    int i, err;
+
+    u = (struct uring *)calloc(1, sizeof(struct uring));
+    if (u == NULL)
+        ABORT("No enough memory");
+
+    memset(&p, 0, sizeof(p));
+    if ((u->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0)
+        goto fail;
+
+    u->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_sz > u->sq_sz)
+            u->sq_sz = u->cq_sz;
+        u->cq_sz = u->sq_sz;
+    }
+    u->sq_ptr = mmap(NULL, u->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ptr == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        u->cq_ptr = u->sq_ptr;
+    else if ((u->cq_ptr = mmap(NULL, u->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+        goto fail;
+    u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe *)mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+        goto fail;
+
+    u->sq_head = (unsigned *)((char *)u->sq_ptr + p.sq_off.head);
+    u->sq_tail = (unsigned *)((char *)u->sq_ptr + p.sq_off.tail);
+    u->sq_mask = (unsigned *)((char *)u->sq_ptr + p.sq_off.ring_mask);
+    u->sq_entries = (unsigned *)((char *)u->sq_ptr + p.sq_off.ring_entries);
+    u->sq_array = (unsigned *)((char *)u->sq_ptr + p.sq_off.array);
+    u->cq_head = (unsigned *)((char *)u->cq_ptr + p.cq_off.head);
+    u->cq_tail = (unsigned *)((char *)u->cq_ptr + p.cq_off.tail);
+    u->cq_mask = (unsigned *)((char *)u->cq_ptr + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((char *)u->cq_ptr + p.cq_off.cqes);
+    u->sqe_tail = *u->sq_tail;
+
+    /* provided buffer ring for the receive side */
+    u->br = (struct io_uring_buf_ring *)mmap(NULL, URING_NBUF * sizeof(struct io_uring_buf),
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u->bufs = (unsigned char *)malloc(URING_NBUF * blk_size);
+    if (u->br == MAP_FAILED || u->bufs == NULL)
+        goto fail;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)u->br;
+    reg.ring_entries = URING_NBUF;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        goto fail;
+    for (i = 0; i < URING_NBUF; i++)
+        uring_put_buf(u, i);
+
+    /* the sending queue as fixed buffer 0 */
+    iov.iov_base = lk->sq;
+    iov.iov_len = lk->sq_size * (lk->sq_mirror ? 2 : 1);
+    u->fixed_send = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0
+        && uring_probe_fixed_send(u, lk->sock, lk->sq);
+
+    u->multishot = 1;
+    lk->uring = u;
+    uring_arm_recv(lk);
+    uring_submit(u);
+
+    return 0;
+
+fail:
+    err = errno;
+    uring_close(u);
+    errno = err;
+    return -1;
+}
+
+/* Queue the next n bytes of the sending queue, both segments when it wraps */
+static void uring_send(link_t *lk, int n)
+{
+    struct uring *u = lk->uring;
+    struct io_uring_sqe *sqe;
+    int start = lk->sq_head, len;
+
+    while (n > 0) {
+        len = n < sq_span(lk, start) ? n : sq_span(lk, start);
+
+        sqe = uring_sqe(u);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = lk->sock;
+        sqe->addr = (unsigned long)(lk->sq + start);
+        sqe->len = len;
+        sqe->user_data = UD_SEND | (unsigned long long)len << 8;
+        if (u->fixed_send) {
+            sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+            sqe->buf_index = 0;
+        }
+        n -= len;
+        if (n > 0)
+            sqe->flags = IOSQE_IO_LINK; /* a short send cancels the rest */
+        u->sending++;
+        start = 0;
+    }
+}
+
+static void uring_complete(link_t *lk, struct io_uring_cqe *cqe)
+{
+    struct uring *u = lk->uring;
+    struct BLK *blk;
+    int res = cqe->res, bid, unsent;
+
+    if (cqe->user_data == UD_RECV) {
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            u->recv_armed = 0;
+
+        if (res > 0) {
+            bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            if ((blk = blk_alloc(lk)) != NULL) {
+                memcpy(blk->data, u->bufs + bid * blk_size, res);
+                blk->wptr = res;
+            } else
+                lk->blk_dropped += res;
+            uring_put_buf(u, bid);
+            if (blk)
+                blk_commit(lk, blk, lk->now);
+        } else if (res == -EINVAL && u->multishot)
+            u->multishot = 0;
+        else if (res == 0 || (res != -ENOBUFS && res != -EAGAIN && res != -EINTR)) {
+            lprintf("TCP disconnected.\n");
+            exit(0);
+        }
+        return;
+    }
+
+    /* the pacer was charged for the whole send, give back what did not go out */
+    u->sending--;
+    unsent = (int)(cqe->user_data >> 8) - (res > 0 ? res : 0);
+    if (unsent > 0) {
+        lk->tokens += unsent;
+        if (u->send_busy)
+            lk->busy_bytes -= unsent;
+        lk->backlog = 1;
+    }
+
+    if (res > 0)
+        sq_inc(lk, lk->sq_head, res);
+    else if (res == -EINVAL && u->fixed_send)
+        u->fixed_send = 0;
+    else if (res != -ECANCELED && res != -EAGAIN && res != -EINTR) {
+        lprintf("TCP Disconnected.\n");
+        exit(0);
+    }
+}
+
+/* Reap completions, then submit the receive re-arm and this tick's sends together */
+static void uring_poll(link_t *lk)
+{
+    struct uring *u = lk->uring;
+    unsigned head = *u->cq_head;
+
+    while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        uring_complete(lk, &u->cqes[head & *u->cq_mask]);
+        __atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);
+    }
+
+    if (!u->recv_armed)
+        uring_arm_recv(lk);
+    socket_send(lk);
+    uring_submit(u);
+}
+
+#endif
+
+/* Timer Management */
+
+/*
+    Hierarchical timing wheel: WHEEL_LEVELS levels of WHEEL_SIZE slots, level L
+    slot covering 2^(WHEEL_BITS*L) ms. Timers further away than the top level
+    wait in an overflow list. Every list is a circular doubly linked list of
+    timer IDs threaded through timer[], the list heads (sentinels) are stored
+    behind the data timers and the ACK timer. Timers that become due are moved,
+    in deadline order, to the expired list which scan_timer() pops from.
+*/
+
+#define ACK_TIMER_ID(lk)         ((lk)->ntimer)
+#define SLOT_LIST(lk, level, slot) ((lk)->ntimer + 1 + (level) * WHEEL_SIZE + (slot))
+#define OVERFLOW_LIST(lk)        ((lk)->ntimer + 1 + WHEEL_LEVELS * WHEEL_SIZE)
+#define EXPIRED_LIST(lk)         (OVERFLOW_LIST(lk) + 1)
+#define NLIST                    (WHEEL_LEVELS * WHEEL_SIZE + 2)
+
+static int ctz64(unsigned long long x)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+    while (!(x & 1)) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+static void timer_init(link_t *lk)
+{
+    struct TIMER *timer = lk->timer;
+    int i;
+
+    for (i = 0; i <= ACK_TIMER_ID(lk); i++)
+        timer[i].list = -1;
+    for (i = SLOT_LIST(lk, 0, 0); i <= EXPIRED_LIST(lk); i++)
+        timer[i].prev = timer[i].next = timer[i].list = i;
+}
+
+static void timer_link(link_t *lk, int nr, int list, int before)
+{
+    struct TIMER *timer = lk->timer;
+
+    timer[nr].list = list;
+    timer[nr].next = before;
+    timer[nr].prev = timer[before].prev;
+    timer[timer[before].prev].next = nr;
+    timer[before].prev = nr;
+}
+
+static void timer_unlink(link_t *lk, int nr)
+{
+    struct TIMER *timer = lk->timer;
+    int list = timer[nr].list;
+
+    timer[timer[nr].prev].next = timer[nr].next;
+    timer[timer[nr].next].prev = timer[nr].prev;
+    timer[nr].list = -1;
+
+    if (list < OVERFLOW_LIST(lk) && timer[list].next == list) {
+        list -= SLOT_LIST(lk, 0, 0);
+        lk->wheel_bits[list / WHEEL_SIZE] &= ~(1ULL << (list % WHEEL_SIZE));
+    }
+}
+
+static void timer_insert(link_t *lk, int nr)
+{
+    struct TIMER *timer = lk->timer;
+    unsigned int t = (unsigned int)timer[nr].deadline;
+    unsigned int delta = t - lk->wheel_now;
+    int level, slot, p, expired = EXPIRED_LIST(lk);
+
+    if ((int)delta <= 0) {
+        /* already due: keep the expired list sorted by deadline */
+        for (p = timer[expired].prev; p != expired && timer[p].deadline > timer[nr].deadline; p = timer[p].prev)
+            ;
+        timer_link(lk, nr, expired, timer[p].next);
+        return;
+    }
+
+    if (delta >= WHEEL_SPAN) {
+        timer_link(lk, nr, OVERFLOW_LIST(lk), OVERFLOW_LIST(lk));
+        return;
+    }
+
+    for (level = 0; delta >= (1u << (WHEEL_BITS * (level + 1))); level++)
+        ;
+    slot = (t >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    timer_link(lk, nr, SLOT_LIST(lk, level, slot), SLOT_LIST(lk, level, slot));
+    lk->wheel_bits[level] |= 1ULL << slot;
+}
+
+static void timer_reinsert_all(link_t *lk, int list)
+{
+    struct TIMER *timer = lk->timer;
+    int nr, next;
+
+    /* detach the whole list first, a timer may be reinserted into it */
+    nr = timer[list].next;
+    timer[list].prev = timer[list].next = list;
+    if (list < OVERFLOW_LIST(lk)) {
+        next = list - SLOT_LIST(lk, 0, 0);
+        lk->wheel_bits[next / WHEEL_SIZE] &= ~(1ULL << (next % WHEEL_SIZE));
+    }
+
+    for (; nr != list; nr = next) {
+        next = timer[nr].next;
+        timer_insert(lk, nr);
+    }
+}
+
+/* Move every timer due at or before 'to' to the expired list */
+static void wheel_advance(link_t *lk, unsigned int to)
+{
+    unsigned int t, idx, level;
+    unsigned long long pending;
+
+    while ((int)(to - lk->wheel_now) > 0) {
+        t = lk->wheel_now + 1;
+        idx = t & WHEEL_MASK;
+
+        if (idx == 0) {
+            lk->wheel_now = t;
+            for (level = 1; level < WHEEL_LEVELS; level++) {
+                unsigned int slot = (t >> (WHEEL_BITS * level)) & WHEEL_MASK;
+                timer_reinsert_all(lk, SLOT_LIST(lk, level, slot));
+                if (slot != 0)
+                    break;
+            }
+            if (level == WHEEL_LEVELS && (t & (WHEEL_SPAN - 1)) == 0)
+                timer_reinsert_all(lk, OVERFLOW_LIST(lk));
+        }
+
+        /* skip empty level-0 slots up to the end of this block */
+        pending = lk->wheel_bits[0] >> idx;
+        if (pending == 0) {
+            t |= WHEEL_MASK;
+            lk->wheel_now = (int)(to - t) < 0 ? to : t;
+            continue;
+        }
+        t += ctz64(pending);
+        if ((int)(to - t) < 0) {
+            lk->wheel_now = to;
+            break;
+        }
+        lk->wheel_now = t;
+        timer_reinsert_all(lk, SLOT_LIST(lk, 0, t & WHEEL_MASK));
+    }
+}
+
+/* Earliest time at which a timer may expire (a lower bound for far timers) */
+static int wheel_next(link_t *lk, int none)
+{
+    struct TIMER *timer = lk->timer;
+    unsigned int level, cur, best = 0, t;
+    unsigned long long bits;
+    int found = 0;
+
+    if (timer[EXPIRED_LIST(lk)].next != EXPIRED_LIST(lk))
+        return timer[timer[EXPIRED_LIST(lk)].next].deadline;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        if ((bits = lk->wheel_bits[level]) == 0)
+            continue;
+        cur = (lk->wheel_now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+        t = lk->wheel_now >> (WHEEL_BITS * level) & ~WHEEL_MASK;
+        if ((cur + 1 < WHEEL_SIZE) && (bits >> (cur + 1)))
+            t += cur + 1 + ctz64(bits >> (cur + 1));
+        else
+            t += WHEEL_SIZE + ctz64(bits);
+        t <<= WHEEL_BITS * level;
+        if (!found || (int)(t - best) < 0)
+            best = t;
+        found = 1;
+    }
+
+    if (timer[OVERFLOW_LIST(lk)].next != OVERFLOW_LIST(lk)) {
+        t = (lk->wheel_now | (WHEEL_SPAN - 1)) + 1;
+        if (!found || (int)(t - best) < 0)
+            best = t;
+        found = 1;
+    }
+
+    return found ? (int)best : none;
+}
+
+/* Withdraw the timeout of a timer that expired into the current batch */
+static void timer_withdraw(link_t *lk, unsigned int nr)
+{
+    if (lk->timer[nr].list != TIMER_PENDING)
+        return;
+    lk->timer[nr].list = -1;
+    if (nr == (unsigned int)ACK_TIMER_ID(lk))
+        batch_cancel(lk, ACK_TIMEOUT, nr);
+    else
+        batch_cancel(lk, DATA_TIMEOUT, nr);
+}
+
+static void timer_set(link_t *lk, unsigned int nr, int deadline)
+{
+    timer_withdraw(lk, nr);
+    if (lk->timer[nr].list >= 0)
+        timer_unlink(lk, nr);
+    lk->timer[nr].deadline = deadline;
+    timer_insert(lk, nr);
+}
+
+void link_start_timer(link_t *lk, unsigned int nr, unsigned int ms)
+{
+    char msg[64];
+
+    if (nr >= (unsigned int)ACK_TIMER_ID(lk)) {
+        sprintf(msg, "start_timer(): timer No. must be 0~%d", ACK_TIMER_ID(lk) - 1);
+        ABORT(msg);
+    }
+    /* plus the time the queued bytes take on the line */
+    timer_set(lk, nr, lk->now + (int)((long long)sq_len(lk) * 8000 / (lk->wire * lk->tx_bps)) + ms);
+}
+
+void link_stop_timer(link_t *lk, unsigned int nr)
+{
+    if (nr >= (unsigned int)ACK_TIMER_ID(lk))
+        return;
+    timer_withdraw(lk, nr);
+    if (lk->timer[nr].list >= 0)
+        timer_unlink(lk, nr);
+}
+
+int link_get_timer(link_t *lk, unsigned int nr)
+{
+    if (nr >= (unsigned int)ACK_TIMER_ID(lk) || lk->timer[nr].list < 0)
+        return 0;  /* stopped, or expired */
+    return lk->timer[nr].deadline > lk->now ? lk->timer[nr].deadline - lk->now : 0;
+}
+
+void link_start_ack_timer(link_t *lk, unsigned int ms)
+{
+    /* a pending timeout counts as running */
+    if (lk->timer[ACK_TIMER_ID(lk)].list == -1)
+        timer_set(lk, ACK_TIMER_ID(lk), lk->now + ms);
+}
+
+void link_stop_ack_timer(link_t *lk)
+{
+    timer_withdraw(lk, ACK_TIMER_ID(lk));
+    if (lk->timer[ACK_TIMER_ID(lk)].list >= 0)
+        timer_unlink(lk, ACK_TIMER_ID(lk));
+}
+
+static int scan_timer(link_t *lk, int *nr)
+{
+    int i;
+
+    wheel_advance(lk, (unsigned int)lk->now);
+
+    if ((i = lk->timer[EXPIRED_LIST(lk)].next) == EXPIRED_LIST(lk))
+        return 0;
+
+    timer_unlink(lk, i);
+    *nr = i;
+    return i == ACK_TIMER_ID(lk) ? ACK_TIMEOUT : DATA_TIMEOUT;
+}
+
+/* Network Layer Functions */
+
+void link_enable_network_layer(link_t *lk)
+{
+    lk->network_layer_active = 1;
+}
+
+void link_disable_network_layer(link_t *lk)
+{
+    lk->network_layer_active = 0;
+
+    /* a packet offered in the current batch is taken back */
+    if (lk->layer3_ready && lk->batch_n > 0) {
+        batch_cancel(lk, NETWORK_LAYER_READY, 0);
+        lk->layer3_ready = 0;
+        lk->nl_ts = lk->nl_prev_ts;
+    }
+}
+
+/* Earliest timestamp at which the (non-flood) network layer offers a packet */
+static int network_layer_due(link_t *lk)
+{
+    int t, gate;
+
+    t = lk->nl_ts + (int)(((long long)PKT_LEN * 3 / 4 * 8000 + lk->tx_bps - 1) / lk->tx_bps);
+
+    if (lk->station == 'b') {
+        gate = lk->rx_delay + (int)((long long)3 * PKT_LEN * 8000 / lk->tx_bps);
+        if (t < gate)
+            t = gate;
+        if (lk->nl_gap == 0)
+            lk->nl_gap = 4000 + (int)(rng_next(&lk->gap_rng) % 500);
+        if (t / 1000 / mode_cycle % 2 != lk->opts.ibib && t < lk->nl_ts + lk->nl_gap) {
+            int next_cycle = (t / 1000 / mode_cycle + 1) * mode_cycle * 1000;
+            t = lk->nl_ts + lk->nl_gap < next_cycle ? lk->nl_ts + lk->nl_gap : next_cycle;
+        }
+    }
+
+    return t;
+}
+
+static int network_layer_ready(link_t *lk)
+{
+    if (!lk->network_layer_active)
+        return 0;
+
+    if (lk->opts.flood)
+        return 1;
+
+    if (lk->now < network_layer_due(lk))
+        return 0;
+
+    lk->nl_prev_ts = lk->nl_ts;
+    lk->nl_ts = lk->now;
+    if (lk->station == 'b')
+        lk->nl_gap = 4000 + (int)(rng_next(&lk->gap_rng) % 500);
+
+    return 1;
+}
+
+/* Payload: 8 bytes of a draw, low byte first, so any host makes the same */
+static void payload_fill(struct rng *r, unsigned char *p, int len)
+{
+    unsigned long long x = 0;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        if (i % 8 == 0)
+            x = rng_next(r);
+        p[i] = (unsigned char)(x >> i % 8 * 8);
+    }
+}
+
+int link_get_packet(link_t *lk, unsigned char *packet)
+{
+    int len;
+
+    if (!lk->layer3_ready)
+        ABORT("get_packet(): Network layer is not ready for a new packet");
+
+    len = PKT_LEN;
+    payload_fill(&lk->tx_rng, packet + 2, len - 2);
+    *(unsigned short *)packet = (lk->station - 'a' + 1) * 10000 + (lk->pkt_no++ % 10000);
+
+    lk->layer3_ready = 0;
+
+    return len;
+}
+
+void link_put_packet(link_t *lk, unsigned char *packet, int len)
+{
+    unsigned char expect[PKT_LEN];
+    int now = lk->now;
+
+    if (len != PKT_LEN)
+        ABORT("Bad Packet length");
+
+    payload_fill(&lk->rx_rng, expect, PKT_LEN - 2);
+    if (memcmp(packet + 2, expect, PKT_LEN - 2) != 0)
+        ABORT("Network Layer received a bad packet from data link layer");
+    lk->rpackets++;
+    lk->rbytes += len;
+
+    if (now - lk->stat_ts > 2000 && now > lk->ts0 + 2000) {
+        double bps;
+        bps = (double)lk->rbytes * 8 * 1000 / (now - lk->ts0);
+        lprintf(".... %d packets received, %.0f bps, %.2f%%, Err %llu (%.1e)\n",
+            lk->rpackets, bps, bps / lk->rx_bps * 100, lk->noise, (double)lk->noise / lk->nbits);
+        lk->stat_ts = now;
+    }
+}
+
+#define DBG_EVENT    0x01
+#define DBG_FRAME    0x02
+#define DBG_WARNING  0x04
+
+void dbg_event(const char *fmt, ...)
+{
+	va_list arg_ptr;
+
+	if (debug_mask & DBG_FRAME) {
+		va_start(arg_ptr, fmt);
+		__v_lprintf(fmt, arg_ptr);
+		va_end(arg_ptr);
+	}
+}
+
+void dbg_frame(const char *fmt, ...)
+{
+	va_list arg_ptr;
+
+	if (debug_mask & DBG_FRAME) {
+		va_start(arg_ptr, fmt);
+		__v_lprintf(fmt, arg_ptr);
+		va_end(arg_ptr);
+	}
+}
+
+void dbg_warning(const char *fmt, ...)
+{
+	va_list arg_ptr;
+
+	if (debug_mask & DBG_WARNING) {
+		va_start(arg_ptr, fmt);
+		__v_lprintf(fmt, arg_ptr);
+		va_end(arg_ptr);
+	}
+}
+
+/* Event Generator */
+
+
+/*
+    Received frames are decoded straight into RF_SMALL buffers recycled
+    through a per-link free list. The rare longer frame moves to a buffer
+    of RF_MAX bytes of its own, freed when it has been received.
+*/
+
+static struct RCV_FRAME *rf_new(int size)
+{
+    struct RCV_FRAME *rf = (struct RCV_FRAME *)malloc(sizeof(struct RCV_FRAME) + size);
+
+    if (rf == NULL)
+        ABORT("No enough memory");
+    rf->frame = (unsigned char *)(rf + 1);
+    rf->size = size;
+
+    return rf;
+}
+
+static struct RCV_FRAME *rf_alloc(link_t *lk)
+{
+    struct RCV_FRAME *rf = lk->rf_free;
+
+    if (rf)
+        lk->rf_free = rf->link;
+    else
+        rf = rf_new(RF_SMALL);
+    rf->len = rf->state = 0;
+    rf->link = NULL;
+
+    return rf;
+}
+
+static void rf_free(link_t *lk, struct RCV_FRAME *rf)
+{
+    if (rf->size != RF_SMALL) {
+        free(rf);
+        return;
+    }
+    rf->link = lk->rf_free;
+    lk->rf_free = rf;
+}
+
+/* the frame being received outgrows RF_SMALL */
+static struct RCV_FRAME *rf_grow(link_t *lk)
+{
+    struct RCV_FRAME *rf = rf_new(RF_MAX), *old = lk->rf_buf;
+
+    rf->len = old->len;
+    rf->state = old->state;
+    rf->link = NULL;
+    memcpy(rf->frame, old->frame, old->len);
+    rf_free(lk, old);
+
+    return lk->rf_buf = rf;
+}
+
+/* take the next received frame off the queue */
+static struct RCV_FRAME *rf_pop(link_t *lk, const char *caller)
+{
+    struct RCV_FRAME *rf = lk->rf_head;
+    char msg[256];
+
+    if (rf == NULL) {
+        sprintf(msg, "%s(): Receiving Queue is empty", caller);
+        ABORT(msg);
+    }
+    lk->rframes++;
+    lk->rf_count--;
+    if (lk->rf_told > 0)
+        lk->rf_told--;
+
+    if ((lk->rf_head = rf->link) == NULL)
+        lk->rf_tail = NULL;
+
+    return rf;
+}
+
+int link_recv_frame(link_t *lk, unsigned char *buf, int size)
+{
+    struct RCV_FRAME *rf;
+    char msg[256];
+    int len;
+
+    if (lk->rf_head && size < lk->rf_head->len) {
+        sprintf(msg, "recv_frame(): %d-byte buffer is too small to save %d-byte received frame", size, lk->rf_head->len);
+        ABORT(msg);
+    }
+    rf = rf_pop(lk, "recv_frame");
+    len = rf->len;
+    memcpy(buf, rf->frame, len);
+    rf_free(lk, rf);
+
+    return len;
+}
+
+/* The next received frame in place, valid until link_recv_frame_release() */
+int link_recv_frame_view(link_t *lk, const unsigned char **frame)
+{
+    if (lk->rf_view)
+        ABORT("recv_frame_view(): the frame viewed before is not released");
+    lk->rf_view = rf_pop(lk, "recv_frame_view");
+    *frame = lk->rf_view->frame;
+
+    return lk->rf_view->len;
+}
+
+void link_recv_frame_release(link_t *lk)
+{
+    if (lk->rf_view == NULL)
+        ABORT("recv_frame_release(): no frame is viewed");
+    rf_free(lk, lk->rf_view);
+    lk->rf_view = NULL;
+}
+
+/* Earliest timestamp at which the link has something to do */
+static int next_deadline(link_t *lk)
+{
+    int t = wheel_next(lk, mode_life + 1);
+
+    if (t > mode_life + 1)
+        t = mode_life + 1;
+
+    if (lk->rx_due < t)
+        t = lk->rx_due;
+
+    /* the next send, once the pacer lets the queue head go */
+    if (sq_len(lk) > 0) {
+        int due = lk->now + pacer_due(lk);
+        if (due <= lk->send_ts)
+            due = lk->send_ts + 1;
+        if (due < t)
+            t = due;
+    }
+
+    if (lk->network_layer_active) {
+        int due = lk->opts.flood ? lk->now : network_layer_due(lk);
+        if (due < t)
+            t = due;
+    }
+
+    return t;
+}
+
+#ifdef __linux__
+
+/* Block on epoll until the socket is readable or timerfd reaches 'deadline' */
+
+static void wait_init(link_t *lk)
+{
+    struct epoll_event ev;
+
+    lk->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    lk->timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (lk->epoll_fd < 0 || lk->timer_fd < 0)
+        ABORT("system epoll_create1()/timerfd_create()");
+
+    /* with io_uring the ring fd signals completions, the socket is its business */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+#ifdef HAVE_IO_URING
+    ev.data.fd = lk->uring ? lk->uring->fd : lk->sock;
+#else
+    ev.data.fd = lk->sock;
+#endif
+    if (epoll_ctl(lk->epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev) < 0)
+        ABORT("system epoll_ctl()");
+
+    ev.data.fd = lk->timer_fd;
+    if (epoll_ctl(lk->epoll_fd, EPOLL_CTL_ADD, lk->timer_fd, &ev) < 0)
+        ABORT("system epoll_ctl()");
+}
+
+static void wait_until(link_t *lk, int deadline)
+{
+    struct itimerspec its;
+    struct epoll_event ev[2];
+    unsigned long long expired;
+    long long ms = (long long)epoch * 1000 + deadline;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = (time_t)(ms / 1000);
+    its.it_value.tv_nsec = (long)(ms % 1000) * 1000000;
+    if (timerfd_settime(lk->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        ABORT("system timerfd_settime()");
+
+    if (epoll_wait(lk->epoll_fd, ev, 2, -1) < 0 && errno != EINTR)
+        ABORT("system epoll_wait()");
+
+    while (read(lk->timer_fd, &expired, sizeof(expired)) > 0)
+        ;
+}
+
+#else
+
+static void wait_init(link_t *lk)
+{
+}
+
+static void wait_until(link_t *lk, int deadline)
+{
+    fd_set rfd;
+    struct timeval tm;
+    int ms = deadline - get_ms();
+
+    if (ms <= 0)
+        return;
+    tm.tv_sec = ms / 1000;
+    tm.tv_usec = ms % 1000 * 1000;
+    FD_ZERO(&rfd);
+    FD_SET(lk->sock, &rfd);
+    if (select((int)(lk->sock + 1), &rfd, 0, 0, &tm) < 0)
+        ABORT("system select()");
+}
+
+#endif
+
+/*
+    Frame decoding, a block at a time. The delimiters (and HDLC escapes)
+    are found with SIMD compares, the nibble pairs between them merged 16
+    or 32 at a time, plain HDLC runs copied as a whole. Noise may set the
+    high bits of a nibble; a pair always decodes to lo | (hi << 4) ^ (hi & 0xf0).
+*/
+
+#ifdef HAVE_AVX2
+/* where to go on: at the first a or b, or where fewer than 32 bytes are left */
+AVX2_TARGET static int scan_avx2(const unsigned char *p, int len, unsigned char a, unsigned char b)
+{
+    const __m256i va = _mm256_set1_epi8((char)a), vb = _mm256_set1_epi8((char)b);
+    __m256i v;
+    unsigned int m;
+    int i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *)(p + i));
+        m = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+        if (m)
+            return i + ctz64(m);
+    }
+
+    return i;
+}
+
+/* returns the number of bytes decoded, a multiple of 32 */
+AVX2_TARGET static int nibble_decode_avx2(unsigned char *dst, const unsigned char *src, int len)
+{
+    const __m256i low = _mm256_set1_epi16(0x00ff), nib = _mm256_set1_epi8(0x0f);
+    const __m256i high = _mm256_set1_epi8((char)0xf0);
+    __m256i a, b, lo, hi;
+    int i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        a = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+        b = _mm256_loadu_si256((const __m256i *)(src + 2 * i + 32));
+        /* pack works per 128-bit lane, the permute puts the quarters in order */
+        lo = _mm256_packus_epi16(_mm256_and_si256(a, low), _mm256_and_si256(b, low));
+        hi = _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+        lo = _mm256_permute4x64_epi64(lo, 0xd8);
+        hi = _mm256_permute4x64_epi64(hi, 0xd8);
+        lo = _mm256_or_si256(lo, _mm256_xor_si256(_mm256_slli_epi16(_mm256_and_si256(hi, nib), 4), _mm256_and_si256(hi, high)));
+        _mm256_storeu_si256((__m256i *)(dst + i), lo);
+    }
+
+    return i;
+}
+#endif
+
+#ifdef HAVE_SSE2
+/* where to go on: at the first a or b, or where fewer than 16 bytes are left */
+static int scan_sse2(const unsigned char *p, int len, unsigned char a, unsigned char b)
+{
+    const __m128i va = _mm_set1_epi8((char)a), vb = _mm_set1_epi8((char)b);
+    __m128i v;
+    unsigned int m;
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(p + i));
+        m = (unsigned int)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+        if (m)
+            return i + ctz64(m);
+    }
+
+    return i;
+}
+
+/* returns the number of bytes decoded, a multiple of 16 */
+static int nibble_decode_sse2(unsigned char *dst, const unsigned char *src, int len)
+{
+    const __m128i low = _mm_set1_epi16(0x00ff), nib = _mm_set1_epi8(0x0f), high = _mm_set1_epi8((char)0xf0);
+    __m128i a, b, lo, hi;
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        a = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        b = _mm_loadu_si128((const __m128i *)(src + 2 * i + 16));
+        lo = _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low));
+        hi = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+        lo = _mm_or_si128(lo, _mm_xor_si128(_mm_slli_epi16(_mm_and_si128(hi, nib), 4), _mm_and_si128(hi, high)));
+        _mm_storeu_si128((__m128i *)(dst + i), lo);
+    }
+
+    return i;
+}
+#endif
+
+/* offset of the first a or b in p[0..len), len if there is none */
+static int scan_special(const unsigned char *p, int len, unsigned char a, unsigned char b)
+{
+    int i = 0;
+
+#ifdef HAVE_AVX2
+    if (cpu_avx2)
+        i = scan_avx2(p, len, a, b);
+#endif
+#ifdef HAVE_SSE2
+    i += scan_sse2(p + i, len - i, a, b);
+#endif
+    while (i < len && p[i] != a && p[i] != b)
+        i++;
+
+    return i;
+}
+
+/* src[0..2*len) to dst[0..len), the inverse of nibble_encode() */
+static void nibble_decode(unsigned char *dst, const unsigned char *src, int len)
+{
+    int i = 0;
+
+#ifdef HAVE_AVX2
+    if (cpu_avx2)
+        i = nibble_decode_avx2(dst, src, len);
+#endif
+#ifdef HAVE_SSE2
+    i += nibble_decode_sse2(dst + i, src + 2 * i, len - i);
+#endif
+    for (; i < len; i++)
+        dst[i] = src[2 * i] | ((src[2 * i + 1] << 4) ^ (src[2 * i + 1] & 0xf0));
+}
+
+/* a frame joins the receiving queue */
+static void rf_push(link_t *lk, struct RCV_FRAME *rf)
+{
+    rf->link = NULL;
+    if (lk->rf_head == NULL)
+        lk->rf_head = lk->rf_tail = rf;
+    else {
+        lk->rf_tail->link = rf;
+        lk->rf_tail = rf;
+    }
+    lk->rf_count++;
+}
+
+/*
+    Impairment stage, between the frame assembler and the receiving queue,
+    set up per direction by --impair. A frame off the line may be dropped,
+    delivered twice, held back until 1 to 'depth' later frames have passed
+    it (one propagation delay at most), and delayed by a random extra time.
+    Extra delays keep the frames in order, they only reorder when held back.
+    The protocols see nothing but the receiving queue, as with bit errors.
+*/
+
+/* uniform in [0, 1) */
+static double imp_unit(link_t *lk)
+{
+    return rng_unit(&lk->imp_rng);
+}
+
+static int imp_jitter(link_t *lk)
+{
+    double j = lk->imp.jitter, d;
+
+    switch (lk->imp.jitter_dist) {
+    case JITTER_EXP:
+        d = -j * log(1.0 - imp_unit(lk));
+        break;
+
+    case JITTER_NORMAL:
+        do /* Box-Muller, drawn again outside 0 ~ 2j to keep the mean */
+            d = j + j / 2 * sqrt(-2 * log(1.0 - imp_unit(lk))) * cos(6.283185307179586 * imp_unit(lk));
+        while (d < 0 || d > 2 * j);
+        break;
+
+    default:
+        d = 2 * j * imp_unit(lk);
+        break;
+    }
+
+    return d < 60000 ? (int)(d + 0.5) : 60000;
+}
+
+/* append to the frames waiting for their time, not before the one ahead */
+static void imp_append(link_t *lk, struct RCV_FRAME *rf, int due)
+{
+    if (lk->imp_tail && due < lk->imp_tail->due)
+        due = lk->imp_tail->due;
+    rf->due = due;
+    rf->link = NULL;
+    if (lk->imp_head == NULL)
+        lk->imp_head = lk->imp_tail = rf;
+    else {
+        lk->imp_tail->link = rf;
+        lk->imp_tail = rf;
+    }
+}
+
+/* a frame passes the frames held back, those passed often enough follow it */
+static void imp_pass(link_t *lk, struct RCV_FRAME *rf, int due)
+{
+    struct RCV_FRAME **pp = &lk->imp_held, *held;
+
+    imp_append(lk, rf, due);
+    while ((held = *pp) != NULL) {
+        if (--held->skip > 0) {
+            pp = &held->link;
+            continue;
+        }
+        *pp = held->link;
+        imp_append(lk, held, due);
+    }
+}
+
+/* a frame off the line */
+static void imp_frame(link_t *lk, struct RCV_FRAME *rf)
+{
+    struct RCV_FRAME *copy = NULL, **pp;
+    int due = lk->now;
+
+    lk->imp_frames++;
+    if (lk->imp.loss > 0.0 && imp_unit(lk) < lk->imp.loss) {
+        lk->imp_dropped++;
+        dbg_warning("Impair a received frame: dropped, %d bytes\n", rf->len);
+        rf_free(lk, rf);
+        return;
+    }
+
+    if (lk->imp.jitter > 0) {
+        due += imp_jitter(lk);
+        lk->imp_delay += due - lk->now;
+    }
+
+    if (lk->imp.dup > 0.0 && imp_unit(lk) < lk->imp.dup) {
+        copy = rf->size == RF_SMALL ? rf_alloc(lk) : rf_new(rf->size);
+        copy->len = rf->len;
+        memcpy(copy->frame, rf->frame, rf->len);
+        lk->imp_duped++;
+        dbg_warning("Impair a received frame: duplicated, %d bytes\n", rf->len);
+    }
+
+    if (lk->imp.reorder > 0.0 && imp_unit(lk) < lk->imp.reorder) {
+        rf->skip = 1 + (int)(imp_unit(lk) * lk->imp.depth);
+        rf->due = lk->now + lk->rx_delay;
+        rf->link = NULL;
+        for (pp = &lk->imp_held; *pp; pp = &(*pp)->link)
+            ;
+        *pp = rf;
+        lk->imp_held_back++;
+        dbg_warning("Impair a received frame: held back for %d frames, %d bytes\n", rf->skip, rf->len);
+    } else
+        imp_pass(lk, rf, due);
+
+    if (copy)
+        imp_pass(lk, copy, due);
+}
+
+/* frames whose time has come go to the receiving queue */
+static void imp_release(link_t *lk)
+{
+    struct RCV_FRAME **pp = &lk->imp_held, *rf;
+
+    while ((rf = *pp) != NULL) {
+        if (rf->due > lk->now) {
+            pp = &rf->link;
+            continue;
+        }
+        *pp = rf->link;
+        imp_append(lk, rf, rf->due);
+    }
+
+    while ((rf = lk->imp_head) != NULL && rf->due <= lk->now) {
+        if ((lk->imp_head = rf->link) == NULL)
+            lk->imp_tail = NULL;
+        rf_push(lk, rf);
+    }
+}
+
+/* when the next frame leaves the impairment stage */
+static int imp_due(link_t *lk)
+{
+    struct RCV_FRAME *rf;
+    int t = lk->imp_head ? lk->imp_head->due : RX_IDLE;
+
+    for (rf = lk->imp_held; rf; rf = rf->link)
+        if (rf->due < t)
+            t = rf->due;
+
+    return t;
+}
+
+static void imp_report(link_t *lk)
+{
+    if (!lk->impaired)
+        return;
+    lprintf("Impairments: %llu frames, %llu dropped, %llu duplicated, %llu held back, %.1f ms extra delay on average\n",
+        lk->imp_frames, lk->imp_dropped, lk->imp_duped, lk->imp_held_back,
+        lk->imp_frames > lk->imp_dropped ? (double)lk->imp_delay / (lk->imp_frames - lk->imp_dropped) : 0.0);
+}
+
+/* a delimiter ends the frame being received if it has anything, or starts one */
+static void rx_flag(link_t *lk)
+{
+    struct RCV_FRAME *rf = lk->rf_buf;
+
+    if (rf == NULL)
+        lk->rf_buf = rf_alloc(lk);
+    else if (rf->len > 0) {
+        lk->rf_buf = NULL;
+        if (lk->impaired)
+            imp_frame(lk, rf);
+        else
+            rf_push(lk, rf);
+    }
+}
+
+/* nibbles between delimiters into the frame being received, state 1: a low nibble is pending */
+static void rx_nibbles(link_t *lk, const unsigned char *src, int n)
+{
+    struct RCV_FRAME *rf = lk->rf_buf;
+    const unsigned char *end = src + n;
+    int k;
+
+    if (rf->state && rf->len < RF_MAX) {
+        rf->frame[rf->len++] |= (*src << 4) ^ (*src & 0xf0);
+        rf->state = 0;
+        src++;
+    }
+    while (end - src >= 2 && rf->len < RF_MAX) {
+        if (rf->len == rf->size)
+            rf = rf_grow(lk);
+        k = (int)(end - src) / 2;
+        if (k > rf->size - rf->len)
+            k = rf->size - rf->len;
+        nibble_decode(rf->frame + rf->len, src, k);
+        rf->len += k;
+        src += 2 * k;
+    }
+    if (src < end && rf->len < RF_MAX) {
+        if (rf->len == rf->size)
+            rf = rf_grow(lk);
+        rf->frame[rf->len] = *src;
+        rf->state = 1;
+    }
+}
+
+/* plain bytes between flags and escapes, state 1: the first one is escaped */
+static void rx_bytes(link_t *lk, const unsigned char *src, int n)
+{
+    struct RCV_FRAME *rf = lk->rf_buf;
+    const unsigned char *end = src + n;
+    int k;
+
+    while (src < end && rf->len < RF_MAX) {
+        if (rf->len == rf->size)
+            rf = rf_grow(lk);
+        if (rf->state) {
+            rf->frame[rf->len++] = *src++ ^ 0x20;
+            rf->state = 0;
+            continue;
+        }
+        k = (int)(end - src);
+        if (k > rf->size - rf->len)
+            k = rf->size - rf->len;
+        memcpy(rf->frame + rf->len, src, k);
+        rf->len += k;
+        src += k;
+    }
+}
+
+/* bytes of the block from rptr on that have arrived by now_ns */
+static int blk_due(link_t *lk, struct BLK *blk, long long now_ns)
+{
+    long long dt = now_ns - blk->arrive_ns;
+    int n;
+
+    if (dt < 0)
+        return 0;
+    if (dt >= blk_arrival(lk, blk, blk->wptr - 1) - blk->arrive_ns)
+        n = blk->wptr;
+    else /* byte i is there once i * 8e9 / rate <= dt */
+        n = (int)(((dt + 1) * blk->bps * lk->wire + 8000000000LL - 1) / 8000000000LL);
+
+    return n > blk->rptr ? n - blk->rptr : 0;
+}
+
+/* decode n bytes into the frame assembler */
+static void rx_decode(link_t *lk, const unsigned char *p, int n)
+{
+    int hdlc = lk->opts.framing == FRAMING_HDLC, i, run;
+    unsigned char flag = hdlc ? HDLC_FLAG : 0xff, esc = hdlc ? HDLC_ESC : 0xff;
+
+    for (i = 0; i < n; i++) {
+        run = scan_special(p + i, n - i, flag, esc);
+        if (run > 0 && lk->rf_buf) {
+            if (hdlc)
+                rx_bytes(lk, p + i, run);
+            else
+                rx_nibbles(lk, p + i, run);
+        }
+        if ((i += run) == n)
+            break;
+        if (p[i] == flag)
+            rx_flag(lk);
+        else if (lk->rf_buf && lk->rf_buf->len < RF_MAX) /* an HDLC escape */
+            lk->rf_buf->state = 1;
+    }
+}
+
+/* ms the delimiter that closes the next frame arrives, RX_IDLE: not in the delay line yet */
+static int rx_frame_end(link_t *lk)
+{
+    struct BLK *blk;
+    unsigned char flag = lk->opts.framing == FRAMING_HDLC ? HDLC_FLAG : 0xff;
+    int i, opening = lk->rf_buf == NULL; /* then the first delimiter only opens a frame */
+
+    for (blk = lk->rblk_head; blk; blk = blk->link) {
+        for (i = blk->rptr; (i += scan_special(blk->data + i, blk->wptr - i, flag, flag)) < blk->wptr; i++) {
+            if (opening) {
+                opening = 0;
+                continue;
+            }
+            return (int)((blk_arrival(lk, blk, i) + 999999) / 1000000);
+        }
+    }
+
+    return RX_IDLE;
+}
 
-    get_ms();
+/* when the receiver has something to do next */
+static void rx_schedule(link_t *lk)
+{
+    lk->rx_next = rx_frame_end(lk);
+    lk->rx_due = lk->rx_next;
+    if (lk->impaired && imp_due(lk) < lk->rx_due)
+        lk->rx_due = imp_due(lk);
 }
 
-/* Physical Layer: Sender */
+/* Decode what the delay line has delivered by now */
+static void rx_commit(link_t *lk)
+{
+    struct BLK *blk;
+    long long now_ns = lk->now * 1000000LL;
+    int n;
+
+    while ((blk = lk->rblk_head) != NULL && (n = blk_due(lk, blk, now_ns)) > 0) {
+        if (lk->ts0 == 0) {
+            lk->ts0 = lk->now;
+            if (lk->ts0 >= n / lk->wire)
+                lk->ts0 -= n / lk->wire;
+        }
 
-/* Sending queue structure */
+        rx_decode(lk, blk->data + blk->rptr, n);
+        if ((blk->rptr += n) < blk->wptr)
+            break;
+        lk->rblk_head = blk->link;
+        blk_free(lk, blk);
+    }
 
-#define SQ_SIZE (128 * 1024) 
+    if (lk->impaired)
+        imp_release(lk);
+    rx_schedule(lk);
+}
 
-static unsigned char sq[SQ_SIZE];
-static int sq_head, sq_tail;
-static int inform_phl_ready = 1;
+/* Move bytes between the sending queue, the channel and the delay line */
+static void poll_io(link_t *lk)
+{
+    fd_set rfd, wfd;
+    struct timeval tm;
+    int nfds;
 
-#define sq_inc(p, n) (p = (p + n) % SQ_SIZE)
+    if (lk->peer)
+        socket_send(lk);
+#ifdef HAVE_IO_URING
+    else if (lk->uring)
+        uring_poll(lk);
+#endif
+    else {
+#ifdef HAVE_ZEROCOPY
+        if (lk->zerocopy)
+            zc_reap(lk);
+#endif
+        tm.tv_sec = tm.tv_usec = 0;
+        FD_ZERO(&rfd);
+        FD_ZERO(&wfd);
+        FD_SET(lk->sock, &rfd);
+        FD_SET(lk->sock, &wfd);
 
-static int send_bytes_allowed = 0;
+        nfds = (int)(lk->sock + 1);
+        if (select(nfds, &rfd, &wfd, 0, &tm) < 0)
+            ABORT("system select()");
 
-static int sq_len(void)
-{
-    return (sq_tail + SQ_SIZE - sq_head) % SQ_SIZE;
-}
+        /* socket send */
+        if (FD_ISSET(lk->sock, &wfd))
+            socket_send(lk);
 
-int phl_sq_len(void)
-{
-    return sq_len();
+        /* socket receive */
+        if (FD_ISSET(lk->sock, &rfd))
+            socket_recv(lk);
+    }
 }
 
-static void send_byte(unsigned char byte)
+/* Deliver the next event that is due at lk->now, NO_EVENT if there is none */
+static int poll_event(link_t *lk, int *arg)
 {
-    inform_phl_ready = 1;
+    int event;
 
-    if (send_bytes_allowed && sq_head == sq_tail) {
-        send(sock, (char *)&byte, 1, 0);
-        send_bytes_allowed--;
-        return;
+    /* commit received socket data */
+    if (lk->rx_due <= lk->now) {
+        rx_commit(lk);
+        if (lk->rf_head)
+            return FRAME_RECEIVED;
     }
 
-    if (sq_len() == SQ_SIZE - 1)
-        ABORT("Physical Layer Sending Queue overflow");
+    /* test socket send/receive */
+    poll_io(lk);
 
-    sq[sq_tail] = byte;
-    sq_inc(sq_tail, 1);
-}
+    /* network layer event */
+    if (network_layer_ready(lk)) {
+        lk->layer3_ready = 1;
+        return NETWORK_LAYER_READY;
+    }
 
-void send_frame(unsigned char *frame, int len)
-{
-    int i;
+    /* check all timers */
+    if ((event = scan_timer(lk, arg)) != 0)
+        return event;
 
-    send_byte(0xff);
-    
-    for (i = 0; i < len; i++) {
-        send_byte(frame[i] & 0x0f);
-        send_byte((frame[i] & 0xf0) >> 4);
+    /* physical layer event */
+    if (lk->inform_phl_ready && sq_len(lk) < lk->sq_level) {
+        lk->inform_phl_ready = 0;
+        return PHYSICAL_LAYER_READY;
     }
-    send_byte(0xff);
+
+    return NO_EVENT;
 }
 
-static int send_sq_data(unsigned int start, unsigned int end1)
+/*
+    Batched poll: every event due at lk->now, in the order poll_event()
+    would return them. The batch stays registered with the link while the
+    caller works through it, so a call that makes a pending entry obsolete
+    (stopping or restarting a timer whose timeout is pending, disabling the
+    network layer, refilling the sending queue) withdraws it as NO_EVENT.
+    The caller moves the cursor batch_pos past an entry before handling it,
+    a timeout behind the cursor is delivered and its timer may start again.
+*/
+static void batch_advance(link_t *lk, int n)
 {
-    int ret;
-
-    if (start >= end1) 
-        return 0;
+    int i;
 
-    ret = send(sock, (char *)&sq[start], end1 - start, 0);
-    if (ret <= 0) {
-        lprintf("TCP Disconnected.\n");
-        exit(0);
+    if (n > lk->batch_n)
+        n = lk->batch_n;
+    for (i = lk->batch_pos; i < n; i++) {
+        if ((lk->batch[i].event == DATA_TIMEOUT || lk->batch[i].event == ACK_TIMEOUT)
+            && lk->timer[lk->batch[i].arg].list == TIMER_PENDING)
+            lk->timer[lk->batch[i].arg].list = -1;
     }
-
-    return ret;
+    if (n > lk->batch_pos)
+        lk->batch_pos = n;
 }
 
-static void socket_send(void)
+static void batch_done(link_t *lk)
 {
-    static int last_ts = 0;
-    int n, send_tail = sq_head, send_bytes;
+    batch_advance(lk, lk->batch_n);
+    lk->batch_n = lk->batch_pos = 0;
+}
 
-    if (last_ts == 0) 
-        last_ts = now;
+static int poll_events(link_t *lk, struct event *ev, int max)
+{
+    int n = 0, event, arg;
 
-    if (now <= last_ts) 
-        return;
+    batch_done(lk);
+    lk->batch = ev;
 
-    send_bytes_allowed = (now - last_ts) * CHAN_BPS / 8 / 1000 * 2;
-    n = sq_len();
-    if (n > send_bytes_allowed)
-        n = send_bytes_allowed;
-    sq_inc(send_tail, n);
+    if (lk->rx_due <= lk->now)
+        rx_commit(lk);
 
-    if (send_tail >= sq_head) 
-        send_bytes = send_sq_data(sq_head, send_tail);
-    else {
-        send_bytes = send_sq_data(sq_head, SQ_SIZE);
-        send_bytes += send_sq_data(0, send_tail);
+    for (; lk->rf_told < lk->rf_count && n < max; lk->rf_told++) {
+        ev[n].event = FRAME_RECEIVED;
+        ev[n++].arg = 0;
     }
 
-    sq_inc(sq_head, send_bytes);
-    send_bytes_allowed -= send_bytes;
-
-    last_ts = now;
-}
+    poll_io(lk);
 
-/* Physical Layer: Receiver */
+    if (n < max && network_layer_ready(lk)) {
+        lk->layer3_ready = 1;
+        ev[n].event = NETWORK_LAYER_READY;
+        ev[n++].arg = 0;
+    }
 
-#define BLKSIZE (16 * CHAN_BPS / 8 / (1000 / DEFAULT_TICK))
+    while (n < max && (event = scan_timer(lk, &arg)) != 0) {
+        lk->timer[arg].list = TIMER_PENDING;
+        ev[n].event = event;
+        ev[n++].arg = arg;
+    }
 
-struct BLK {
-    int commit_ts;
-    int rptr, wptr;
-    struct BLK *link;
-    unsigned char data[BLKSIZE];
-};
+    if (n < max && lk->inform_phl_ready && sq_len(lk) < lk->sq_level) {
+        lk->inform_phl_ready = 0;
+        ev[n].event = PHYSICAL_LAYER_READY;
+        ev[n++].arg = 0;
+    }
 
-static struct BLK *rblk_head, *rblk_tail;
-static unsigned int nbits;
+    lk->batch_n = n;
+    return n;
+}
 
-static void socket_recv(void)
+/* Hand a batch to 'handler' in order, skipping withdrawn entries */
+static void batch_run(link_t *lk, struct event *ev, int n, void (*handler)(link_t *lk, int event, int arg))
 {
-    struct BLK *blk;
-    unsigned char *p;
-
-    blk = (struct BLK *)malloc(sizeof(struct BLK));
-    if (blk == NULL) 
-        ABORT("No enough memory");
+    int i;
 
-    blk->rptr = 0;
-    blk->wptr = recv(sock, (char *)blk->data, BLKSIZE, 0);
-    if (blk->wptr <= 0) {
-        lprintf("TCP disconnected.\n");
-        exit(0);
+    for (i = 0; i < n; i++) {
+        batch_advance(lk, i + 1);
+        if (ev[i].event == NO_EVENT)
+            continue;
+        handler(lk, ev[i].event, ev[i].arg);
     }
-    nbits += blk->wptr * 4;
-
-    /* Impose noise */
-    if (ber != 0.0) {
-        int a;
-        double rate, fact;
-
-        rate = (double)noise / nbits;
-        fact = rate > ber ? 3.5 : 6.0;
-        a = (int)((1.0 - pow(1.0 - ber, fact * blk->wptr)) * (RAND_MAX + 1.0) + 0.5);
-        if (rand() <= a) {
-            p = &blk->data[rand() % blk->wptr];
-            if (*p & 0x0f) {
-                *p ^= 1 << (rand() % 8);
-                noise++;
-                dbg_warning("Impose noise on received data, %u/%u=%.1E\n", noise, nbits, (double)noise / nbits);
-            }
+}
+
+/* Withdraw a pending event of the current batch */
+static void batch_cancel(link_t *lk, int event, int arg)
+{
+    int i;
+
+    for (i = lk->batch_pos; i < lk->batch_n; i++) {
+        if (lk->batch[i].event == event && lk->batch[i].arg == arg) {
+            lk->batch[i].event = NO_EVENT;
+            return;
         }
     }
+}
 
-    blk->commit_ts = now + CHAN_DELAY - 10;
-    blk->link = NULL; 
+/* Sleep until socket data arrives or the next deadline of a TCP link */
+static void wait_next(link_t *lk)
+{
+    int deadline;
+
+    magic_check();
+    deadline = next_deadline(lk);
+    if (deadline > lk->now) {
+        static time_t last_warn;
+        int late;
+
+        wait_until(lk, deadline);
+        late = get_ms() - deadline;
+        if (late > 50 && time(0) > last_warn + 1) {
+            lprintf("** WARNING: System too busy, sleep %d ms, but be awakened %d ms later\n",
+                deadline - lk->now, deadline - lk->now + late);
+            last_warn = time(0);
+        }
+    }
 
-    if (rblk_head == NULL) 
-        rblk_head = rblk_tail = blk;
-    else {
-        rblk_tail->link = blk;
-        rblk_tail = blk;
+    if (lk->now > mode_life) {
+        pacer_report(lk);
+        blk_report(lk);
+        imp_report(lk);
+        ge_report(lk);
+        lprintf("Quit.\n");
+        exit(0);
     }
 }
 
-static unsigned char recv_byte(void)
+int link_wait_for_event(link_t *lk, int *arg)
 {
-    unsigned char ch;
-    struct BLK *blk = rblk_head;
+    int event;
 
-    if (blk == NULL || blk->commit_ts > now) 
-        ABORT("recv_byte(): Receiving Queue is empty");
+    if (lk->peer)
+        ABORT("wait_for_event(): a simulated link is driven by link_run()");
 
-    ch = blk->data[blk->rptr++];
-    if (blk->rptr == blk->wptr) {
-        rblk_head = blk->link;
-        free(blk);
-    } 
-    
-    return ch;
-}
+    link_select(lk);
+    batch_done(lk);
 
-/* Timer Management */
+    for (;;) {
 
-#define NTIMER 129
-static int timer[NTIMER];
-#define ACK_TIMER_ID (NTIMER - 1)
+        lk->now = get_ms();
 
-void start_timer(unsigned int nr, unsigned int ms)
-{
-    if (nr >= ACK_TIMER_ID) 
-        ABORT("start_timer(): timer No. must be 0~128");
-    timer[nr] = now + phl_sq_len() * 8000 / CHAN_BPS + ms;
-}
+        if ((event = poll_event(lk, arg)) != NO_EVENT)
+            return event;
 
-void stop_timer(unsigned int nr)
-{
-    if (nr < ACK_TIMER_ID) 
-        timer[nr] = 0;
+        wait_next(lk);
+    }
 }
 
-int get_timer(unsigned int nr)
+int link_wait_for_events(link_t *lk, struct event *ev, int max)
 {
-    if (nr >= ACK_TIMER_ID || timer[nr] == 0)
-        return 0;
-    return timer[nr] > now ? timer[nr] - now : 0;
-}
+    int n;
 
-void start_ack_timer(unsigned int ms)
-{
-    if (timer[ACK_TIMER_ID] == 0)
-        timer[ACK_TIMER_ID] = now + ms;
-}
+    if (lk->peer)
+        ABORT("wait_for_events(): a simulated link is driven by link_run()");
 
-void stop_ack_timer(void)
-{
-    timer[ACK_TIMER_ID] = 0;
-}
+    link_select(lk);
 
-static int scan_timer(int *nr)
-{
-    int i;
+    for (;;) {
 
-    for (i = 0; i < NTIMER; i++) {
-        if (timer[i] && timer[i] <= now) {
-            *nr = i;
-            timer[i] = 0;
-            return i == ACK_TIMER_ID ? ACK_TIMEOUT : DATA_TIMEOUT;
-        }
+        lk->now = get_ms();
+
+        if ((n = poll_events(lk, ev, max)) > 0)
+            return n;
+
+        wait_next(lk);
     }
-    return 0;
 }
 
-/* Network Layer Functions */
+void link_events_handled(link_t *lk, int n)
+{
+    batch_advance(lk, n);
+}
 
-static int network_layer_active = 0;
-static int rpackets, rbytes;
+/*
+    Simulated links are spread over shards, one per worker thread pinned to
+    a CPU. A shard owns whole link pairs and its own virtual clock, so the
+    workers share nothing but read-only parameters. Within a shard a binary
+    heap orders the links by next_deadline(): the clock jumps to the top
+    link, which is polled until it runs out of events. Bytes sent at t arrive
+    at the peer no earlier than t + delay, the delay being 11 ms at least,
+    so no link can be affected by anything happening at the same instant.
+*/
+
+struct shard {
+    int id, cpu;
+    link_t **links;          /* link pairs, adjacent */
+    int nlinks;
+    link_t **heap;           /* links by deadline */
+    void (*handler)(link_t *lk, int event, int arg);
+    THREAD thread;
+    double wall;             /* seconds spent in the event loop */
+    unsigned long long frames, packets;
+    char pad[64];            /* keep the counters of two workers apart */
+};
 
-void enable_network_layer(void)
+static void heap_swap(link_t **heap, int i, int j)
 {
-    network_layer_active = 1;
+    link_t *lk = heap[i];
+
+    heap[i] = heap[j];
+    heap[j] = lk;
+    heap[i]->heap_pos = i;
+    heap[j]->heap_pos = j;
 }
 
-void disable_network_layer(void)
+static void heap_update(struct shard *sh, link_t *lk, int deadline)
 {
-    network_layer_active = 0;
+    link_t **heap = sh->heap;
+    int i = lk->heap_pos, c;
+
+    lk->deadline = deadline;
+
+    while (i > 0 && heap[(i - 1) / 2]->deadline > deadline) {
+        heap_swap(heap, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+
+    while ((c = 2 * i + 1) < sh->nlinks) {
+        if (c + 1 < sh->nlinks && heap[c + 1]->deadline < heap[c]->deadline)
+            c++;
+        if (heap[c]->deadline >= deadline)
+            break;
+        heap_swap(heap, i, c);
+        i = c;
+    }
 }
 
-static int network_layer_ready(void)
+static void shard_run(struct shard *sh)
 {
-    static int last_ts = 0;
+    struct event ev[EVENT_BATCH];
+    link_t *lk, *peer;
+    int i, n, t;
+    double t0 = wall_clock();
 
-    if (!network_layer_active)
-        return 0;
+    sh->heap = (link_t **)malloc(sizeof(link_t *) * sh->nlinks);
+    if (sh->heap == NULL)
+        ABORT("No enough memory");
+    for (i = 0; i < sh->nlinks; i++) {
+        sh->heap[i] = sh->links[i];
+        sh->links[i]->heap_pos = i;
+        sh->links[i]->deadline = 0;
+    }
 
-    if (mode_flood) 
-        return 1;
+    sim_now = 0;
 
-    if ((now - last_ts) * CHAN_BPS / 8 / 1000 < PKT_LEN * 3 / 4)
-        return 0;
+    while ((lk = sh->heap[0])->deadline <= mode_life) {
+        sim_now = lk->deadline;
+
+        link_select(lk);
+        lk->now = sim_now;
+        while ((n = poll_events(lk, ev, EVENT_BATCH)) > 0)
+            batch_run(lk, ev, n, sh->handler);
 
-    if (station == 'b') {
-        if (now / 1000 / mode_cycle % 2 != mode_ibib) {
-            if (now - last_ts < 4000 + rand() % 500)
-                return 0;
+        if (lk->tx_blk) {
+            peer_flush(lk);
+            if ((peer = lk->peer) != NULL && peer->rx_due < peer->deadline)
+                heap_update(sh, peer, peer->rx_due);
         }
-        if (now < CHAN_DELAY + 3 * PKT_LEN * 8000 / CHAN_BPS)
-            return 0;
+
+        t = next_deadline(lk);
+        heap_update(sh, lk, t > sim_now ? t : sim_now);
     }
 
-    last_ts = now;
+    sh->wall = wall_clock() - t0;
+    sim_now = mode_life + 1;
 
-    return 1;
+    for (i = 0; i < sh->nlinks; i++) {
+        sh->frames += sh->links[i]->rframes;
+        sh->packets += sh->links[i]->rpackets;
+    }
+    free(sh->heap);
 }
 
-static int randA(void)
+static THREAD_FUNC shard_thread(void *arg)
 {
-    static unsigned int holdrand = 0x65109bc4;
-    return ((holdrand = holdrand * 214013L + 2531011L) >> 16) & 0x7fff;
+    struct shard *sh = (struct shard *)arg;
+
+    thread_pin(sh->cpu);
+    log_echo = 0;
+    shard_run(sh);
+
+    return 0;
 }
 
-static int randB(void)
+/* Run the simulated links on 'nshard' workers and report the throughput */
+static void engine_run(void (*handler)(link_t *lk, int event, int arg))
 {
-    static unsigned int holdrand = 0x1e459090;
-    return ((holdrand = holdrand * 214013L + 2531011L) >> 16) & 0x7fff;
-}
+    struct shard *shards;
+    int i, npairs = nlinks / 2, nshard, ncpu = cpu_count(), first;
+    unsigned long long frames = 0, packets = 0;
+    unsigned long long blk_exhausted = 0, blk_dropped = 0;
+    unsigned long long imp_frames = 0, imp_dropped = 0, imp_duped = 0, imp_held_back = 0;
+    unsigned long long ge_bits[2] = { 0, 0 }, ge_bursts = 0;
+    int impaired = 0;
+    double wall, t0, rate = 0;
+    int nbusy = 0, blk_high = 0;
+
+    nshard = mode_threads > 0 ? mode_threads : ncpu;
+    if (nshard > npairs)
+        nshard = npairs;
+
+    shards = (struct shard *)calloc(nshard, sizeof(struct shard));
+    if (shards == NULL)
+        ABORT("No enough memory");
 
-#define next_char() ((unsigned char)(my_rand() & 0xff))
+    for (i = 0, first = 0; i < nshard; i++) {
+        int last = (int)((long long)npairs * (i + 1) / nshard);
 
-static int layer3_ready = 0;
+        shards[i].id = i;
+        shards[i].cpu = i % ncpu;
+        shards[i].links = links + 2 * first;
+        shards[i].nlinks = 2 * (last - first);
+        shards[i].handler = handler;
+        first = last;
+    }
 
-int get_packet(unsigned char *packet)
-{
-    static int pkt_no = 0;
-    int i, len;
-    int (*my_rand)(void) = station == 'a' ? randA : randB;
+    lprintf("Running %d link pairs on %d worker threads (%d CPUs) ...\n", npairs, nshard, ncpu);
+    fflush(stdout);
 
-    if (!layer3_ready)
-        ABORT("get_packet(): Network layer is not ready for a new packet");
-    
-    len = PKT_LEN;
-    for (i = 2; i < len; i++)
-        packet[i] = next_char();
-    *(unsigned short *)packet = (station - 'a' + 1) * 10000 + (pkt_no++ % 10000);
+    t0 = wall_clock();
+    for (i = 0; i < nshard; i++) {
+        if (thread_start(&shards[i].thread, shard_thread, &shards[i]) != 0)
+            ABORT("Failed to create worker thread");
+    }
+    for (i = 0; i < nshard; i++)
+        thread_join(shards[i].thread);
+    wall = wall_clock() - t0;
 
-    layer3_ready = 0;
+    magic_check();
+    sim_now = mode_life + 1;
 
-    return len;
-}
+    for (i = 0; i < nshard; i++) {
+        struct shard *sh = &shards[i];
 
-static int ts0;
+        lprintf("Worker %d (CPU %d): %d links, %llu frames, %llu packets, %.3f s, %.0f frames/s\n",
+            sh->id, sh->cpu, sh->nlinks, sh->frames, sh->packets, sh->wall,
+            sh->wall > 0 ? sh->frames / sh->wall : 0.0);
+        frames += sh->frames;
+        packets += sh->packets;
+    }
+    if (wall <= 0)
+        wall = 1e-6;
+    lprintf("Total: %llu frames, %llu packets in %.3f s, %.0f frames/s, %.0f frames/s per core, %.0fx real time\n",
+        frames, packets, wall, frames / wall, frames / wall / nshard, (mode_life + 1) / 1000.0 / wall);
 
-void put_packet(unsigned char *packet, int len)
-{
-    static int last_ts = 0;
-    int i, (*my_rand)(void) = station == 'a' ? randB : randA;
+    for (i = 0; i < nlinks; i++) {
+        link_t *lk = links[i];
 
-    if (len != PKT_LEN) 
-        ABORT("Bad Packet length");
+        if (lk->busy_ns > 0) {
+            rate += lk->busy_bytes * 8e9 / lk->wire / lk->busy_ns / pacer_line_rate(lk);
+            nbusy++;
+        }
+    }
+    if (nbusy > 0)
+        lprintf("Line rate: %.3f%% of configured on average over %d links with a backlog\n",
+            rate * 100 / nbusy, nbusy);
+    for (i = 0; i < nlinks; i++) {
+        if (links[i]->blk_high > blk_high)
+            blk_high = links[i]->blk_high;
+        blk_exhausted += links[i]->blk_exhausted;
+        blk_dropped += links[i]->blk_dropped;
+    }
+    lprintf("Receive blocks: %d in use at most on a link, pool exhausted %llu times, %llu bytes dropped\n",
+        blk_high, blk_exhausted, blk_dropped);
+    for (i = 0; i < nlinks; i++) {
+        impaired |= links[i]->impaired;
+        imp_frames += links[i]->imp_frames;
+        imp_dropped += links[i]->imp_dropped;
+        imp_duped += links[i]->imp_duped;
+        imp_held_back += links[i]->imp_held_back;
+    }
+    if (impaired)
+        lprintf("Impairments: %llu frames, %llu dropped, %llu duplicated, %llu held back\n",
+            imp_frames, imp_dropped, imp_duped, imp_held_back);
+    for (i = 0; i < nlinks; i++) {
+        ge_bits[0] += links[i]->ge_bits[0];
+        ge_bits[1] += links[i]->ge_bits[1];
+        ge_bursts += links[i]->ge_bursts;
+    }
+    if (opts.ge.p > 0.0 && ge_bits[0] + ge_bits[1] > 0)
+        lprintf("Burst errors: %.3f%% of %llu bits in the bad state, %llu bursts\n",
+            ge_bits[1] * 100.0 / (ge_bits[0] + ge_bits[1]), ge_bits[0] + ge_bits[1], ge_bursts);
+    lprintf("Quit.\n");
+    exit(0);
+}
 
-    for (i = 2; i < PKT_LEN; i++) {
-        if (packet[i] != next_char()) 
-            ABORT("Network Layer received a bad packet from data link layer");
+/* Drive every open link and call 'handler' for each event */
+void link_run(void (*handler)(link_t *lk, int event, int arg))
+{
+    struct event ev[EVENT_BATCH];
+    struct shard sh;
+    int n, i;
+
+    if (nlinks == 1 && links[0]->peer == NULL) {
+        for (;;) {
+            n = link_wait_for_events(links[0], ev, EVENT_BATCH);
+            batch_run(links[0], ev, n, handler);
+        }
     }
-    rpackets++;
-    rbytes += len;
 
-    if (now - last_ts > 2000 && now > ts0 + 2000) {
-        double bps;
-        bps = (double)rbytes * 8 * 1000 / (now - ts0);
-        lprintf(".... %d packets received, %.0f bps, %.2f%%, Err %d (%.1e)\n", 
-            rpackets, bps, bps / CHAN_BPS * 100, noise, (double)noise/nbits);
-        last_ts = now;
+    if (nlinks > 2)
+        engine_run(handler);
+
+    /* a single pair keeps its per-station logs */
+    memset(&sh, 0, sizeof(sh));
+    sh.links = links;
+    sh.nlinks = nlinks;
+    sh.handler = handler;
+    shard_run(&sh);
+
+    magic_check();
+    for (i = 0; i < nlinks; i++) {
+        link_select(links[i]);
+        pacer_report(links[i]);
+        blk_report(links[i]);
+        imp_report(links[i]);
+        ge_report(links[i]);
+        lprintf("Quit.\n");
     }
+    exit(0);
 }
 
-#define DBG_EVENT    0x01
-#define DBG_FRAME    0x02
-#define DBG_WARNING  0x04
+/* Single-link API, working on the link of this station */
 
-void dbg_event(char *fmt, ...)
+static link_t *the_link(void)
 {
-	va_list arg_ptr;
-
-	if (debug_mask & DBG_FRAME) {
-		va_start(arg_ptr, fmt);
-		__v_lprintf(fmt, arg_ptr);
-		va_end(arg_ptr);
-	}
+    if (cur_link == NULL)
+        ABORT("protocol_init() must be called first");
+    return cur_link;
 }
 
-void dbg_frame(char *fmt, ...)
+int wait_for_event(int *arg)
 {
-	va_list arg_ptr;
-
-	if (debug_mask & DBG_FRAME) {
-		va_start(arg_ptr, fmt);
-		__v_lprintf(fmt, arg_ptr);
-		va_end(arg_ptr);
-	}
+    return link_wait_for_event(the_link(), arg);
 }
 
-void dbg_warning(char *fmt, ...)
+int wait_for_events(struct event *ev, int max)
 {
-	va_list arg_ptr;
-
-	if (debug_mask & DBG_WARNING) {
-		va_start(arg_ptr, fmt);
-		__v_lprintf(fmt, arg_ptr);
-		va_end(arg_ptr);
-	}
+    return link_wait_for_events(the_link(), ev, max);
 }
 
-/* Event Generator */
+void events_handled(int n)
+{
+    link_events_handled(the_link(), n);
+}
 
-#define PHL_SQ_LEVEL  50 
+void enable_network_layer(void)
+{
+    link_enable_network_layer(the_link());
+}
 
-static int sleep_cnt, start_ms, wakeup_ms, busy_cnt;
-static int bias_cnt;
+void disable_network_layer(void)
+{
+    link_disable_network_layer(the_link());
+}
 
-struct RCV_FRAME {
-    int len;
-    int state;
-    unsigned char frame[2048];
-    struct RCV_FRAME *link;
-};
+int get_packet(unsigned char *packet)
+{
+    return link_get_packet(the_link(), packet);
+}
 
-static struct RCV_FRAME *rf_head, *rf_tail, *rf_buf;
+void put_packet(unsigned char *packet, int len)
+{
+    link_put_packet(the_link(), packet, len);
+}
 
 int recv_frame(unsigned char *buf, int size)
 {
-    int len;
-    struct RCV_FRAME *next;
-    char msg[256];
-
-    if (rf_head == NULL) 
-        ABORT("recv_frame(): Receiving Queue is empty");
-
-    len = rf_head->len;
-
-    if (size < len) { 
-        sprintf(msg, "recv_frame(): %d-byte buffer is too small to save %d-byte received frame", size, len);
-        ABORT(msg);
-    }
-    
-    memcpy(buf, rf_head->frame, len);
-
-    next = rf_head->link;
-    if (next == NULL) 
-        rf_tail = NULL;
-    free(rf_head); 
-    rf_head = next;
-
-    return len;
+    return link_recv_frame(the_link(), buf, size);
 }
 
-int wait_for_event(int *arg)
+int recv_frame_view(const unsigned char **frame)
 {
-    fd_set rfd, wfd;
-    struct timeval tm;
-    int event, n, i, nfds;
-    unsigned char ch;
-
-    for (;;) {
-
-        now = get_ms();
-     
-        /* commit received socket data */
-        if (rblk_head && rblk_head->commit_ts <= now) {
-            n = rblk_head->wptr - rblk_head->rptr;
-            
-            if (ts0 == 0) {
-                ts0 = now;
-                if (ts0 >= n / 2)
-                    ts0 -= n / 2;
-            }
-
-            for (i = 0; i < n; i++) {
-                ch = recv_byte();
-                if (ch == 0xff) {
-                    if (rf_buf == NULL) 
-                        rf_buf = (struct RCV_FRAME *)calloc(1, sizeof(struct RCV_FRAME));
-                    else {
-                        if (rf_buf->len > 0) {
-                            if (rf_head == NULL) 
-                                rf_head = rf_tail = rf_buf;
-                            else {
-                                rf_tail->link = rf_buf;
-                                rf_tail = rf_buf;
-                            }
-                            rf_buf = NULL;
-                        }
-                    }
-                } else if (rf_buf && rf_buf->len < sizeof(rf_buf->frame)) {
-                    if (rf_buf->state == 0) {
-                        rf_buf->frame[rf_buf->len] = ch;
-                        rf_buf->state = 1;
-                    } else {
-                        rf_buf->frame[rf_buf->len] |= (ch << 4) ^ (ch & 0xf0);
-                        rf_buf->len++;
-                        rf_buf->state = 0;
-                    }
-                }
-            }
+    return link_recv_frame_view(the_link(), frame);
+}
 
-            if (rf_head)
-                return FRAME_RECEIVED;
-        }
-        
-        /* test socket send/receive */
-        tm.tv_sec = tm.tv_usec = 0;
-        FD_ZERO(&rfd);
-        FD_ZERO(&wfd);
-        FD_SET(sock, &rfd);
-        FD_SET(sock, &wfd);
+void recv_frame_release(void)
+{
+    link_recv_frame_release(the_link());
+}
 
-        nfds = (int)(sock + 1);
-        if (select(nfds, &rfd, &wfd, 0, &tm) < 0) 
-            ABORT("system select()");
-         
-        /* socket send */
-        if (FD_ISSET(sock, &wfd)) 
-            socket_send();
+void send_frame(unsigned char *frame, int len)
+{
+    link_send_frame(the_link(), frame, len);
+}
 
-        /* socket receive */
-        if (FD_ISSET(sock, &rfd)) 
-            socket_recv();
+void send_frame_iov(const struct iovec *iov, int iovcnt)
+{
+    link_send_frame_iov(the_link(), iov, iovcnt);
+}
 
-        /* network layer event */
-        if (network_layer_ready()) {
-            layer3_ready = 1;
-            return NETWORK_LAYER_READY;
-        }
+int phl_sq_len(void)
+{
+    return link_phl_sq_len(the_link());
+}
 
-        /* check all timers */
-        if ((event = scan_timer(arg)) != 0)
-            return event;
+void start_timer(unsigned int nr, unsigned int ms)
+{
+    link_start_timer(the_link(), nr, ms);
+}
 
-        /* physical layer event */
-        if (inform_phl_ready && phl_sq_len()  < PHL_SQ_LEVEL) {
-            inform_phl_ready = 0;
-            return PHYSICAL_LAYER_READY;
-        }
-
-        /* delay 'mode_tick' ms */
-        if (1) {
-            int ms0, t;
-            static time_t last_warn;
-            ms0 = get_ms();
-            magic_check();
-            Sleep(mode_tick);
-            t = get_ms() - ms0;
-            if (t > mode_tick + 50 && time(0) > last_warn + 1) {
-                lprintf("** WARNING: System too busy, sleep %d ms, but be awakened %d ms later\n", 
-                    mode_tick, t);
-                last_warn = time(0);
-            }
-        } else {
-            int ticks, ms;
-
-            sleep_cnt++;
-
-            ms = get_ms();
-            if (start_ms == 0)
-                start_ms = ms;
-            else if (ms - wakeup_ms > 1) {
-                ticks = (ms - start_ms) / mode_tick;
-                lprintf("====== CPU BUSY for %d ms (cnt %d)\n", ms - wakeup_ms, ++busy_cnt);
-                lprintf("------ noSleep %d, sleep %d, Elapse %d ticks\n", ticks - sleep_cnt, sleep_cnt, ticks);
-            }
+void stop_timer(unsigned int nr)
+{
+    link_stop_timer(the_link(), nr);
+}
 
-            magic_check();
-            ms = get_ms();
-            Sleep(mode_tick);
-            wakeup_ms = get_ms();
+int get_timer(unsigned int nr)
+{
+    return link_get_timer(the_link(), nr);
+}
 
-            ms = wakeup_ms - ms;
-            if (ms > mode_tick + 1 || ms < mode_tick - 1) 
-                lprintf("++++++ Sleep(%d)=%d+%d (cnt %d)\n", mode_tick, mode_tick, ms - mode_tick, ++bias_cnt);
-        }
+void start_ack_timer(unsigned int ms)
+{
+    link_start_ack_timer(the_link(), ms);
+}
 
-        if (now > mode_life) {
-            lprintf("Quit.\n");
-            exit(0);
-        }
-    }
+void stop_ack_timer(void)
+{
+    link_stop_ack_timer(the_link());
 }
 
 
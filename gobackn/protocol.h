@@ -13,6 +13,15 @@ extern "C" {
 #include <stdio.h>
 #include <string.h>
 
+#ifdef _WIN32
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#endif
+
 #include "lprintf.h"
 
 /* Initalization */ 
@@ -27,6 +36,31 @@ extern int wait_for_event(int *arg);
 #define DATA_TIMEOUT         3
 #define ACK_TIMEOUT          4
 
+/*
+    Batched events: every event ready at the moment of the call, in the
+    order wait_for_event() would deliver them, one FRAME_RECEIVED per
+    received frame. Handle them in order. An entry made obsolete by a call
+    before it is reached (stop_timer()/start_timer() on a pending timeout,
+    disable_network_layer() on a pending NETWORK_LAYER_READY, send_frame()
+    filling the sending queue up) turns into NO_EVENT; skip those. The
+    array must stay untouched until the next call.
+
+    Call events_handled(i + 1) before handling entry i: a timeout up to
+    there counts as delivered, its timer is stopped and may be started
+    again, while a later one is still pending (start_ack_timer() leaves
+    a pending ACK_TIMEOUT alone). The next wait_for_events() takes the
+    whole batch as handled.
+*/
+struct event {
+    int event;        /* NETWORK_LAYER_READY ... ACK_TIMEOUT, or NO_EVENT */
+    int arg;          /* timer No. of DATA_TIMEOUT */
+};
+
+#define NO_EVENT (-1)
+
+extern int wait_for_events(struct event *ev, int max);
+extern void events_handled(int n);
+
 /* Network Layer functions */
 #define PKT_LEN 256
 
@@ -37,26 +71,110 @@ extern void put_packet(unsigned char *packet, int len);
 
 /* Physical Layer functions */
 extern int  recv_frame(unsigned char *buf, int size);
+extern int  recv_frame_view(const unsigned char **frame); /* in place, until recv_frame_release() */
+extern void recv_frame_release(void);
 extern void send_frame(unsigned char *frame, int len);
+extern void send_frame_iov(const struct iovec *iov, int iovcnt); /* the pieces make one frame */
 
 extern int  phl_sq_len(void);
 
 /* CRC-32 polynomium coding function */
 extern unsigned int crc32(unsigned char *buf, int len);
+extern unsigned int crc32_update(unsigned int crc, unsigned char *buf, int len); /* crc32(a + b) == crc32_update(crc32(a), b) */
 
 /* Timer Management functions */
 extern unsigned int get_ms(void);
 extern void start_timer(unsigned int nr, unsigned int ms);
 extern void stop_timer(unsigned int nr);
+extern int  get_timer(unsigned int nr);
 extern void start_ack_timer(unsigned int ms);
 extern void stop_ack_timer(void);
 
 /* Protocol Debugger */
 extern char *station_name(void);
 
-extern void dbg_event(char *fmt, ...);
-extern void dbg_frame(char *fmt, ...);
-extern void dbg_warning(char *fmt, ...);
+extern void dbg_event(const char *fmt, ...);
+extern void dbg_frame(const char *fmt, ...);
+extern void dbg_warning(const char *fmt, ...);
+
+/* Link Context: one data link (station) per handle, for hosting many links */
+typedef struct link link_t;
+
+/* Impairments of the frames coming off the line, before the receiving queue */
+struct link_impair {
+    double loss;      /* probability that a frame is dropped */
+    double dup;       /* probability that a frame is delivered twice */
+    double reorder;   /* probability that a frame is held back behind later ones */
+    int depth;        /* ... 1 to depth of them (0: 3) */
+    int jitter;       /* extra delay (ms) of a frame on average, the order is kept */
+    int jitter_dist;  /* JITTER_UNIFORM, JITTER_EXP or JITTER_NORMAL */
+};
+
+#define JITTER_UNIFORM 0  /* 0 ~ 2 * jitter */
+#define JITTER_EXP     1  /* exponential */
+#define JITTER_NORMAL  2  /* standard deviation jitter / 2, within 0 ~ 2 * jitter */
+
+/* Gilbert-Elliott burst errors: a good and a bad state, each with a BER of its own */
+struct link_ge {
+    double p;         /* probability per bit of going from good to bad (0: off) */
+    double r;         /* ... from bad to good */
+    double ber_good, ber_bad;
+};
+
+struct link_opts {
+    int station;      /* 'a' or 'b' */
+    double ber;       /* Bit Error Rate of received data */
+    int flood;        /* flood traffic */
+    int ibib;         /* station B layer 3 sender mode IDLE-BUSY-... */
+    int ntimer;       /* data timers No. 0~ntimer-1 (0: default 65536) */
+    int sq_size;      /* sending queue bytes (0: default 128K), whole pages */
+    int framing;      /* FRAMING_NIBBLE or FRAMING_HDLC, the same at both ends */
+    long long bps[2]; /* line rate (bits/s), [0]: A to B, [1]: B to A (0: 8000) */
+    int delay[2];     /* propagation delay (ms, at least 11), as bps[] (0: 270) */
+    long long burst;  /* bytes the transmitter may send at once (0: 2 ticks of the line) */
+    int blk_pool;     /* receive blocks in the delay line at most (0: enough for the line) */
+    struct link_impair impair[2]; /* as bps[] (all 0: none) */
+    struct link_ge ge;  /* burst errors instead of ber */
+    const char *trace[2]; /* channel trace file, as bps[] (NULL: none) */
+    unsigned long long seed; /* of every random stream, the same at both ends */
+    int pair;         /* index of the link pair, each draws streams of its own */
+};
+
+#define FRAMING_NIBBLE 0  /* 0xff delimiters, every byte sent as two nibbles */
+#define FRAMING_HDLC   1  /* 0x7e flags, 0x7e/0x7d escaped as 0x7d, byte ^ 0x20 */
+
+extern link_t *link_open(const struct link_opts *opts);
+extern void link_close(link_t *link);
+extern void link_pair(link_t *a, link_t *b);  /* in-memory channel on the virtual clock */
+
+extern int  link_count(void);
+extern link_t *link_get(int i);
+extern void link_set_user(link_t *link, void *user);
+extern void *link_user(link_t *link);
+extern char *link_station_name(link_t *link);
+
+extern void link_run(void (*handler)(link_t *link, int event, int arg));
+extern int  link_wait_for_event(link_t *link, int *arg);
+extern int  link_wait_for_events(link_t *link, struct event *ev, int max);
+extern void link_events_handled(link_t *link, int n);
+
+extern void link_enable_network_layer(link_t *link);
+extern void link_disable_network_layer(link_t *link);
+extern int  link_get_packet(link_t *link, unsigned char *packet);
+extern void link_put_packet(link_t *link, unsigned char *packet, int len);
+
+extern int  link_recv_frame(link_t *link, unsigned char *buf, int size);
+extern int  link_recv_frame_view(link_t *link, const unsigned char **frame);
+extern void link_recv_frame_release(link_t *link);
+extern void link_send_frame(link_t *link, unsigned char *frame, int len);
+extern void link_send_frame_iov(link_t *link, const struct iovec *iov, int iovcnt);
+extern int  link_phl_sq_len(link_t *link);
+
+extern void link_start_timer(link_t *link, unsigned int nr, unsigned int ms);
+extern void link_stop_timer(link_t *link, unsigned int nr);
+extern int  link_get_timer(link_t *link, unsigned int nr);
+extern void link_start_ack_timer(link_t *link, unsigned int ms);
+extern void link_stop_ack_timer(link_t *link);
 
 #define MARK lprintf("File \"%s\" (%d)\n", __FILE__, __LINE__)
 
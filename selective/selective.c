@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include "selective.h"
@@ -22,18 +23,47 @@ typedef struct {
     int Len;
 } Buffer;
 
-static Buffer InBuf[NR_BUFS], OutBuf[NR_BUFS];
-static bool PhlReady = false;
-static SeqNr RecvBase = 0;
-static SeqNr SendBase = 0, NextSeqNr = 0;
-static bool Acked[MAX_SEQ + 1] = {false};
-static bool Cached[MAX_SEQ + 1] = {false};
+// 每条链路的协议状态
+typedef struct {
+    link_t* Link;
+    Buffer InBuf[NR_BUFS], OutBuf[NR_BUFS];
+    bool PhlReady;
+    SeqNr RecvBase;
+    SeqNr SendBase, NextSeqNr;
+    bool Acked[MAX_SEQ + 1];
+    bool Cached[MAX_SEQ + 1];
+} Window;
 
 // 发送帧到物理层
-static void PutFrame(unsigned char* Frame, int Len) {
+static void PutFrame(Window* W, unsigned char* Frame, int Len) {
     *(unsigned int*)(Frame + Len) = crc32(Frame, Len);
-    send_frame(Frame, Len + 4);
-    PhlReady = false;
+    link_send_frame(W->Link, Frame, Len + 4);
+    W->PhlReady = false;
+}
+
+// 分段发送帧: 帧头、数据和CRC直接编码进发送队列，不拼装整帧
+static void PutFrameIOV(Window* W, unsigned char* Head, int HeadLen, unsigned char* Data, int Len) {
+    struct iovec IOV[3];
+    unsigned int CRC = crc32_update(crc32(Head, HeadLen), Data, Len);
+
+    IOV[0].iov_base = Head;
+    IOV[0].iov_len = HeadLen;
+    IOV[1].iov_base = Data;
+    IOV[1].iov_len = Len;
+    IOV[2].iov_base = &CRC;
+    IOV[2].iov_len = 4;
+    link_send_frame_iov(W->Link, IOV, 3);
+    W->PhlReady = false;
+}
+
+// 发送缓冲区中的数据帧
+static void SendData(Window* W, SeqNr Seq) {
+    unsigned char Head[2];
+    Buffer* B = &W->OutBuf[Seq % NR_BUFS];
+
+    Head[0] = FRAME_DATA;
+    Head[1] = Seq;  // 序列号
+    PutFrameIOV(W, Head, 2, B->Buf, B->Len);
 }
 
 // 判断序号是否在窗口范围内
@@ -41,141 +71,140 @@ static bool Between(SeqNr A, SeqNr B, SeqNr C) {
     A %= (MAX_SEQ + 1);
     B %= (MAX_SEQ + 1);
     C %= (MAX_SEQ + 1);
-    
-    return (((A <= B) && (B <= C)) || 
-            ((C <= A) && (A <= B)) || 
+
+    return (((A <= B) && (B <= C)) ||
+            ((C <= A) && (A <= B)) ||
             ((B <= C) && (C <= A)));
 }
 
 // 处理网络层就绪事件
-void NetworkLayerReadyHandler(int* Arg) {
+void NetworkLayerReadyHandler(Window* W, int* Arg) {
     // 获取网络层数据包并缓存
-    int Len = get_packet(OutBuf[NextSeqNr % NR_BUFS].Buf);
-    OutBuf[NextSeqNr % NR_BUFS].Len = Len;
+    int Len = link_get_packet(W->Link, W->OutBuf[W->NextSeqNr % NR_BUFS].Buf);
+    W->OutBuf[W->NextSeqNr % NR_BUFS].Len = Len;
 
     // 立即发送数据帧并启动计时器
-    Frame S;
-    S.Kind = FRAME_DATA;
-    S.AckSeq = NextSeqNr;  // 序列号
-    
-    memcpy(S.Data, OutBuf[NextSeqNr % NR_BUFS].Buf, PKT_LEN);
-
-    dbg_frame("Send DATA %d, ID %d\n", S.AckSeq, *(short*)S.Data);
-    PutFrame((unsigned char*)&S, 2 + Len);
-    start_timer(S.AckSeq, DATA_TIMER);
+    dbg_frame("Send DATA %d, ID %d\n", W->NextSeqNr, *(short*)W->OutBuf[W->NextSeqNr % NR_BUFS].Buf);
+    SendData(W, W->NextSeqNr);
+    link_start_timer(W->Link, W->NextSeqNr, DATA_TIMER);
 
     // 更新下一个要发送的序列号
-    NextSeqNr = (NextSeqNr + 1) % (MAX_SEQ + 1);
+    W->NextSeqNr = (W->NextSeqNr + 1) % (MAX_SEQ + 1);
 }
 
 // 处理物理层就绪事件
-void PhysicalLayerReadyHandler(int* Arg) {
-    PhlReady = true;
+void PhysicalLayerReadyHandler(Window* W, int* Arg) {
+    W->PhlReady = true;
 }
 
 // 处理帧接收事件
-void FrameReceivedHandler(int* Arg) {
-    Frame F;
-    int Len = recv_frame((unsigned char*)&F, sizeof(F));
-    
+void FrameReceivedHandler(Window* W, int* Arg) {
+    // 在接收缓冲区中原地解析帧
+    const unsigned char* P;
+    int Len = link_recv_frame_view(W->Link, &P);
+    const Frame* F = (const Frame*)P;
+
     // 检查帧CRC校验
-    if (Len > 6 && crc32((unsigned char*)&F, Len) != 0) {
+    if (Len < 6 || Len > (int)sizeof(Frame) || crc32((unsigned char*)P, Len) != 0) {
+        link_recv_frame_release(W->Link);
         dbg_event("**** Receiver Error, Bad CRC Checksum\n");
         return; // 忽略错误帧
     }
 
     // 处理ACK帧
-    if (F.Kind == FRAME_ACK && Between(SendBase, F.AckSeq, (SendBase + NR_BUFS - 1))) {
-        Acked[F.AckSeq] = true;  // 标记为已确认
-        dbg_frame("Recv ACK %d\n", F.AckSeq);
-        stop_timer(F.AckSeq);
+    if (F->Kind == FRAME_ACK && Between(W->SendBase, F->AckSeq, (W->SendBase + NR_BUFS - 1))) {
+        W->Acked[F->AckSeq] = true;  // 标记为已确认
+        dbg_frame("Recv ACK %d\n", F->AckSeq);
+        link_stop_timer(W->Link, F->AckSeq);
 
         // 滑动发送窗口
-        while (Acked[SendBase]) {
-            Acked[SendBase] = false;
-            SendBase = (SendBase + 1) % (MAX_SEQ + 1);
-            
-            if (SendBase == NextSeqNr)
+        while (W->Acked[W->SendBase]) {
+            W->Acked[W->SendBase] = false;
+            W->SendBase = (W->SendBase + 1) % (MAX_SEQ + 1);
+
+            if (W->SendBase == W->NextSeqNr)
                 break;
         }
     }
 
     // 处理数据帧
-    if (F.Kind == FRAME_DATA) {
-        dbg_frame("Recv DATA %d, ID %d\n", F.AckSeq, *(short*)F.Data);
+    if (F->Kind == FRAME_DATA) {
+        dbg_frame("Recv DATA %d, ID %d\n", F->AckSeq, *(short*)F->Data);
 
         // 发送ACK确认
         Frame S;
         S.Kind = FRAME_ACK;
-        S.AckSeq = F.AckSeq;  // 确认号
-        
+        S.AckSeq = F->AckSeq;  // 确认号
+
         dbg_frame("Send ACK %d\n", S.AckSeq);
-        PutFrame((unsigned char*)&S, 2);
+        PutFrame(W, (unsigned char*)&S, 2);
 
         // 如果在接收窗口内
-        if (Between(RecvBase, F.AckSeq, (RecvBase + NR_BUFS - 1))) {
+        if (Between(W->RecvBase, F->AckSeq, (W->RecvBase + NR_BUFS - 1))) {
             // 缓存帧数据
-            if (!Cached[F.AckSeq]) {
-                memcpy(InBuf[F.AckSeq % NR_BUFS].Buf, F.Data, Len - 6);
-                InBuf[F.AckSeq % NR_BUFS].Len = Len - 6;
-                Cached[F.AckSeq] = true;
+            if (!W->Cached[F->AckSeq]) {
+                memcpy(W->InBuf[F->AckSeq % NR_BUFS].Buf, F->Data, Len - 6);
+                W->InBuf[F->AckSeq % NR_BUFS].Len = Len - 6;
+                W->Cached[F->AckSeq] = true;
             }
-            
+
             // 向上层传递按序到达的数据
-            while (Cached[RecvBase]) {
-                Cached[RecvBase] = false;
-                put_packet(InBuf[RecvBase % NR_BUFS].Buf, InBuf[RecvBase % NR_BUFS].Len);
-                RecvBase = (RecvBase + 1) % (MAX_SEQ + 1);
+            while (W->Cached[W->RecvBase]) {
+                W->Cached[W->RecvBase] = false;
+                link_put_packet(W->Link, W->InBuf[W->RecvBase % NR_BUFS].Buf, W->InBuf[W->RecvBase % NR_BUFS].Len);
+                W->RecvBase = (W->RecvBase + 1) % (MAX_SEQ + 1);
             }
         }
     }
+
+    link_recv_frame_release(W->Link);
 }
 
 // 处理数据超时事件
-void DataTimeoutHandler(int* Arg) {
+void DataTimeoutHandler(Window* W, int* Arg) {
     SeqNr Num = *Arg;
 
     // 重传超时的数据帧
-    Frame S;
-    S.Kind = FRAME_DATA;
-    S.AckSeq = Num;
-    
-    memcpy(S.Data, OutBuf[Num % NR_BUFS].Buf, PKT_LEN);
-
-    PutFrame((unsigned char*)&S, 2 + OutBuf[Num % NR_BUFS].Len);
-    start_timer(Num, DATA_TIMER);
+    SendData(W, Num);
+    link_start_timer(W->Link, Num, DATA_TIMER);
 
-    dbg_frame("Timeout, ReSend DATA %d, ID %d\n", S.AckSeq, *(short*)S.Data);
+    dbg_frame("Timeout, ReSend DATA %d, ID %d\n", Num, *(short*)W->OutBuf[Num % NR_BUFS].Buf);
 }
 
 // 事件处理函数表
-void (*EventHandler[])(int*) = {
+void (*EventHandler[])(Window*, int*) = {
     [NETWORK_LAYER_READY] = NetworkLayerReadyHandler,
     [PHYSICAL_LAYER_READY] = PhysicalLayerReadyHandler,
     [FRAME_RECEIVED] = FrameReceivedHandler,
     [DATA_TIMEOUT] = DataTimeoutHandler,
 };
 
-int main(int argc, char** argv) {
-    int Event, Arg;
-
-    protocol_init(argc, argv);
-    lprintf("Designed by Jiang Yanjun, build: " __DATE__ "  "__TIME__ "\n");
+// 处理一条链路上的一个事件
+static void Dispatch(link_t* Link, int Event, int Arg) {
+    Window* W = link_user(Link);
 
-    disable_network_layer();
+    // 调用对应的事件处理函数
+    EventHandler[Event](W, &Arg);
 
-    for (;;) {
-        Event = wait_for_event(&Arg);
+    // 根据窗口状态启用/禁用网络层
+    if (Between(W->SendBase, W->NextSeqNr, (W->SendBase + NR_BUFS - 1)) && W->PhlReady)
+        link_enable_network_layer(Link);
+    else
+        link_disable_network_layer(Link);
+}
 
-        // 调用对应的事件处理函数
-        EventHandler[Event](&Arg);
+int main(int argc, char** argv) {
+    protocol_init(argc, argv);
+    lprintf("Designed by Jiang Yanjun, build: " __DATE__ "  "__TIME__ "\n");
 
-        // 根据窗口状态启用/禁用网络层
-        if (Between(SendBase, NextSeqNr, (SendBase + NR_BUFS - 1)) && PhlReady)
-            enable_network_layer();
-        else
-            disable_network_layer();
+    for (int i = 0; i < link_count(); i++) {
+        Window* W = calloc(1, sizeof(Window));
+        W->Link = link_get(i);
+        link_set_user(W->Link, W);
+        link_disable_network_layer(W->Link);
     }
 
+    link_run(Dispatch);
+
     return 0;
-}    
\ No newline at end of file
+}